@@ -9,27 +9,99 @@
  *   - Enhanced text formatting:
  *       - Number all lines (-n)
  *       - Number nonblank lines (-b)
- *       - Squeeze repeated blank lines (-s)
+ *       - Squeeze repeated blank lines (-s, --squeeze-limit=N)
  *       - Display end-of-line markers (-e)
  *       - Visualize TAB characters as "^I" (-T)
- *       - Convert nonprinting characters (-v)
+ *       - Convert nonprinting characters (-v), using ^ and M- notation
  *       - The -A flag is equivalent to -v -T -e.
  *   - Follow mode (-f): Continuously output appended data (tail -f style).
+ *   - Line ending conversion: CRLF to LF (--unix-eol) or LF to CRLF (--dos-eol).
+ *   - UTF-16 input (BOM-detected, or --from-utf16) is transcoded to UTF-8.
+ *   - JSON Lines output (--json-lines): each line as an escaped JSON string.
+ *   - Literal line filters (--match=STR, --exclude=STR), before or after numbering.
+ *   - Per-line file name prefixes (--with-filename[=basename]).
+ *   - Duplicate line removal: adjacent (--uniq[=count]) or global (--dedupe).
+ *   - Time-ordered merge of sorted logs by their leading timestamps (--merge).
+ *   - Time-ordered follow of several live logs (-f --merge, --skew=MS).
+ *   - Directory follow that picks up new files (-f --watch-dir, --pattern).
+ *   - Progress report with throughput and ETA on standard error (--progress).
+ *   - Per-file binary detection that skips formatting or dumps hex (--auto).
+ *   - Output fan-out to more files and pipes (--tee, --tee-policy).
+ *   - Length-prefixed binary records instead of lines (--framed, --frame-seq).
+ *   - Long-line guard that truncates or wraps at a byte or character limit
+ *     (--max-line).
+ *   - Line sampling (--sample=1/N, --sample-rate=P with --seed=S).
+ *   - Line and byte counts (--count), like wc -l without the pipe.
+ *   - Hex dump (--hex) in hexdump -C layout, and byte ranges (--bytes=START-END).
+ *   - Digests computed while copying (--digest=crc32c|xxh3|sha256), per input
+ *     and/or over the output, in sha256sum format.
+ *   - gzip and zstd input is decompressed in-process (built with CC_HAVE_ZLIB
+ *     and/or CC_HAVE_ZSTD), and the output can be compressed (--compress).
  *
  * Performance:
  *   - Uses a larger buffer (8192 bytes) to reduce system calls.
- *   - Memory mapping is employed for files ≥1MB to avoid extra copying.
+ *   - Memory mapping is employed for files ≥64KB to avoid extra copying. Files
+ *     are mapped in windows and re-checked between them; a SIGBUS from a file
+ *     truncated underneath us is caught and treated as a short read.
  *   - A fast path in text processing bypasses per-character handling when possible.
+ *   - -s on its own squeezes whole blocks at once, scanning for runs of
+ *     newlines with SSE2 instead of splitting the input into lines.
+ *   - -v expands bytes through a precomputed 256-entry table and skips runs of
+ *     printable ASCII with SSE2 when available.
+ *   - -v/-T on their own never split input into lines; on mapped files, 64KB
+ *     blocks with nothing to expand are sent straight from the file.
+ *   - On Linux, raw output of regular files and pipes stays inside the kernel
+ *     (copy_file_range, splice or sendfile).
+ *   - Standard input is inspected with fstat, so redirected files and pipes
+ *     get the same engines as named files.
+ *   - --match/--exclude search whole blocks (mapped windows included) for the
+ *     string, testing its first and last bytes 16 positions at a time with
+ *     SSE2; only hits are mapped back to their lines.
+ *   - --with-filename writes each prefix and the line it precedes as separate
+ *     spans of one writev, so lines are never copied to be prefixed.
+ *   - --dedupe keeps 64-bit line hashes in an open-addressing set and turns
+ *     it into a Bloom filter of the same size at its memory cap.
+ *   - --merge maps its inputs and writes records from a heap-based k-way
+ *     merge as spans of the mappings (writev), without copying them.
+ *   - --watch-dir waits on inotify for the directory instead of polling it,
+ *     and reads only the files an event names.
+ *   - --progress costs the engines one relaxed atomic add per block; a timer
+ *     thread does the reporting.
+ *   - --tee duplicates kernel-side copies with tee(2), so the data never
+ *     enters user space; other output is written from one shared buffer.
+ *   - --framed writes each record header and line as spans of one writev.
+ *   - --max-line cuts lines as they stream in, so memory stays bounded by the
+ *     limit; characters are counted 16 bytes at a time with SSE2.
+ *   - --sample jumps over the lines it leaves out by counting newlines 16
+ *     bytes at a time; only sampled lines are split out and formatted.
+ *   - --count finds newlines 16 bytes at a time with SSE2 and popcount, and
+ *     counts large mapped windows on one thread per CPU.
+ *   - --hex formats whole rows from a template, converting 16 bytes to hex
+ *     digits at once with SSSE3 when available.
+ *   - --digest uses the SSE4.2 crc32 instruction and SHA-NI when compiled in;
+ *     on the zero-copy path the input is hashed by a helper thread while the
+ *     kernel copies it.
+ *   - Compressed input is decoded on its own thread, which hands blocks to the
+ *     text engine through a ring buffer; BGZF blocks and sized zstd frames of
+ *     regular files are decoded in parallel.
+ *   - --compress cuts the output into 1MB blocks that a pool of threads
+ *     compresses into independent gzip members or zstd frames, written in order.
  *
  * Usage: cc [OPTION]... [FILE]...
  * If FILE is "-" or omitted, input is read from standard input.
  */
 
+#ifdef __linux__
+  #define _GNU_SOURCE  /* splice() and copy_file_range() */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
 #ifdef _WIN32
   #include <windows.h>
   #include <io.h>
@@ -40,12 +112,139 @@
   #include <sys/stat.h>
   #include <fcntl.h>
   #include <unistd.h>
+  #include <setjmp.h>
+  #include <pthread.h>
+  #include <sys/uio.h>
+  #include <dirent.h>
+  #include <fnmatch.h>
+  #include <poll.h>
+#endif
+#ifdef __linux__
+  #include <sys/sendfile.h>
+  #include <sys/inotify.h>
+#endif
+#ifdef CC_HAVE_ZLIB
+  #include <zlib.h>   /* gzip input; link with -lz */
+#endif
+#ifdef CC_HAVE_ZSTD
+  #include <zstd.h>   /* zstd input; link with -lzstd */
+#endif
+#if defined(CC_HAVE_ZLIB) || defined(CC_HAVE_ZSTD)
+  #define CC_HAVE_DECOMPRESS 1
+  #define CC_HAVE_COMPRESS 1
+#endif
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+  #include <tmmintrin.h>  /* pshufb for --hex */
+#endif
+#if defined(__SSE4_2__) && defined(__x86_64__)
+  #include <nmmintrin.h>
+  #define CC_HW_CRC32C 1  /* crc32 instruction for --digest=crc32c */
+#endif
+#if defined(__SHA__) && defined(__SSE4_1__)
+  #include <immintrin.h>  /* SHA-NI for --digest=sha256 */
 #endif
 
 /* Buffer size for I/O */
 #define BUFSIZE 8192
-/* 1MB threshold for memory mapping */
-#define MMAP_THRESHOLD (1024 * 1024)
+/* 64KB threshold for memory mapping */
+#define MMAP_THRESHOLD (64 * 1024)
+/* Size of each mapped window; the file size is re-checked between windows */
+#define MMAP_WINDOW (64 * 1024 * 1024)
+/* Granularity at which the hybrid -v/-T engine decides between copying and transforming */
+#define HYBRID_BLOCK (64 * 1024)
+/* Bytes of input normalized at a time by --unix-eol/--dos-eol */
+#define EOL_CHUNK (64 * 1024)
+/* Bytes of UTF-16 input transcoded at a time */
+#define UTF16_CHUNK (64 * 1024)
+/* Most --tee outputs, and the buffer they share with standard output */
+#define TEE_MAX 16
+#define TEE_BUF (64 * 1024)
+/* Bytes moved per zero-copy system call */
+#define ZEROCOPY_CHUNK (1024 * 1024)
+/* Length of a full --hex row with an 8-digit offset (hexdump -C layout) */
+#define HEX_ROW_LEN 79
+/* --hex rows formatted before each write */
+#define HEX_BATCH 512
+/* Decompressed bytes per ring buffer slot, and slots between reader and engine */
+#define RING_SLOT (256 * 1024)
+#define RING_SLOTS 4
+/* Parallel decompression: largest member, members and bytes per batch, threads */
+#define MEMBER_MAX (16 * 1024 * 1024)
+#define MEMBER_BATCH 256
+#define MEMBER_BATCH_BYTES (64 * 1024 * 1024)
+#define MEMBER_THREADS 64
+/* Uncompressed bytes per --compress block (one gzip member or zstd frame each) */
+#define COMP_BLOCK (1024 * 1024)
+/* Most --compress worker threads; twice as many blocks are kept in flight */
+#define COMP_THREADS 16
+/* Mapped text --progress counts as it is formatted, in slices of this size */
+#define PROGRESS_SLICE (4 * 1024 * 1024)
+/* Most bytes -f --merge holds back per file */
+#define FOLLOW_MERGE_CAP (8 * 1024 * 1024)
+/* Line spans gathered for one writev by --with-filename */
+#define SPAN_IOVS 1024
+/* --count: smallest part of a mapped window given its own thread, and most threads */
+#define COUNT_CHUNK (8 * 1024 * 1024)
+#define COUNT_THREADS 16
+
+/* Line ending conversions (Options.eol_mode) */
+#define EOL_KEEP 0
+#define EOL_UNIX 1  /* CRLF -> LF */
+#define EOL_DOS  2  /* LF -> CRLF (existing CRLF is kept as is) */
+
+/* UTF-16 input handling (Options.from_utf16, TextState.utf16) */
+#define UTF16_NONE (-1) /* Input is not transcoded */
+#define UTF16_AUTO 0    /* Transcode if a BOM is found (text mode only) */
+#define UTF16_BOM  1    /* --from-utf16: BOM picks the byte order, little-endian without one */
+#define UTF16_LE   2
+#define UTF16_BE   3
+
+/* JSON Lines output (Options.json_lines) */
+#define JSON_STRING 1   /* "line" */
+#define JSON_OBJECT 2   /* {"n":N,"line":"line"} */
+
+/* Compressed input and output (Options.decompress, Options.compress, compression_of) */
+#define DECOMP_AUTO   0 /* Detect compressed input when text is formatted */
+#define DECOMP_ALWAYS 1 /* --decompress */
+#define DECOMP_NEVER  2 /* --no-decompress */
+#define COMP_NONE 0
+#define COMP_GZIP 1
+#define COMP_ZSTD 2
+
+/* --with-filename (Options.with_filename) */
+#define FILENAME_PATH 1 /* The name as given */
+#define FILENAME_BASE 2 /* =basename: without its directories */
+
+/* --merge timestamp formats (Options.merge) */
+#define MERGE_ISO   1   /* YYYY-MM-DD[T ]HH:MM:SS[.frac] */
+#define MERGE_EPOCH 2   /* Seconds since 1970[.frac] */
+
+/* --auto handling of binary inputs (Options.auto_mode) */
+#define AUTO_RAW 1   /* Copy them unformatted */
+#define AUTO_HEX 2   /* Dump them as with --hex */
+/* Bytes --auto samples from the start of each input */
+#define AUTO_SAMPLE 8192
+
+/* --framed record length encodings (Options.framed) */
+#define FRAME_VARINT 1   /* Unsigned LEB128 */
+#define FRAME_U32    2   /* 4 bytes, little-endian */
+/* Longest record header: a 10-byte varint and a u64 sequence number */
+#define FRAME_HDR_MAX 18
+
+/* What a --tee output that cannot keep up does (Options.tee_policy) */
+#define TEE_BLOCK 0   /* Everything waits for it */
+#define TEE_DROP  1   /* It loses what it has no room for */
+
+/* --digest algorithms (Options.digest) */
+#define DIGEST_CRC32C 1
+#define DIGEST_XXH3   2
+#define DIGEST_SHA256 3
+/* What --digest covers (Options.digest_of bits) */
+#define DIGEST_INPUT  1 /* Each input file as read */
+#define DIGEST_OUTPUT 2 /* Everything written to standard output */
 
 /* Options structure */
 typedef struct {
@@ -57,6 +256,46 @@ typedef struct {
     int flag_nonprinting; /* -v: show nonprinting characters (except TAB/NL) */
     int flag_follow;      /* -f: follow file (tail -f style) */
     int squeeze_limit;    /* Maximum allowed consecutive blank lines */
+    int eol_mode;         /* --unix-eol/--dos-eol: EOL_UNIX or EOL_DOS, EOL_KEEP otherwise */
+    int from_utf16;       /* --from-utf16[=le|be]: UTF16_BOM, UTF16_LE or UTF16_BE; UTF16_AUTO otherwise */
+    int json_lines;       /* --json-lines[=object]: JSON_STRING or JSON_OBJECT, 0 otherwise */
+    int hex;              /* --hex: dump input in hexdump -C layout */
+    long long range_start; /* --bytes=START-END: first byte of each input to read */
+    long long range_end;   /* One past the last byte to read, or -1 for EOF */
+    int digest;           /* --digest=ALG: DIGEST_CRC32C, DIGEST_XXH3 or DIGEST_SHA256, 0 otherwise */
+    int digest_of;        /* --digest-of=input|output|both: DIGEST_INPUT and/or DIGEST_OUTPUT */
+    const char *digest_file; /* --digest-file=PATH: where digests go (stderr if NULL) */
+    int decompress;       /* DECOMP_AUTO, DECOMP_ALWAYS or DECOMP_NEVER */
+    int compress;         /* --compress=gzip|zstd: COMP_GZIP or COMP_ZSTD, COMP_NONE otherwise */
+    const char *match;    /* --match=STR: keep only lines containing STR, or NULL */
+    const char *exclude;  /* --exclude=STR: drop lines containing STR, or NULL */
+    size_t match_len, exclude_len;
+    int filter_after;     /* --filter-after: filter the numbered/squeezed output, not the input */
+    int count;            /* --count: report line and byte counts instead of the contents */
+    long long sample_every; /* --sample=1/N: keep every Nth line, 0 otherwise */
+    double sample_rate;   /* --sample-rate=P: keep each line with probability P, -1 otherwise */
+    long long seed;       /* --seed=S for --sample-rate, or -1 to seed from the clock */
+    int with_filename;    /* --with-filename[=basename]: FILENAME_PATH or FILENAME_BASE, 0 otherwise */
+    int uniq;             /* --uniq: drop lines equal to the line before */
+    int uniq_count;       /* --uniq=count: prefix each line with the length of its run */
+    int dedupe;           /* --dedupe: drop lines seen anywhere before */
+    long long dedupe_memory; /* --dedupe-memory=SIZE: cap on the set of seen lines */
+    int merge;            /* --merge[=iso|epoch]: MERGE_ISO or MERGE_EPOCH, 0 otherwise */
+    int skew_ms;          /* --skew=MS: how long -f --merge holds records back */
+    const char *watch_dir; /* -f --watch-dir=DIR: follow the files of a directory */
+    const char *watch_pattern; /* --pattern=GLOB: which of them */
+    int max_open;         /* --max-open=N: most files --watch-dir keeps open */
+    int progress;         /* --progress: report bytes done, throughput and ETA */
+    int auto_mode;        /* --auto[=raw|hex]: AUTO_RAW or AUTO_HEX for binary inputs, 0 otherwise */
+    const char *tee_path[TEE_MAX]; /* --tee=PATH: more outputs for the same stream */
+    int tee_count;
+    int tee_policy;       /* --tee-policy=block|drop: TEE_BLOCK or TEE_DROP */
+    int framed;           /* --framed[=varint|u32]: FRAME_VARINT or FRAME_U32, 0 otherwise */
+    int frame_seq;        /* --frame-seq: a u64 line number after each record length */
+    long long max_line;   /* --max-line=N: longest line let through, 0 for no limit */
+    int max_line_chars;   /* ...counted in UTF-8 characters rather than bytes */
+    int max_line_wrap;    /* ...longer lines are wrapped rather than truncated */
+    int max_line_marker;  /* ...truncated lines end in a [+N bytes] marker */
     const char *line_format; /* Format for line numbers */
     const char *tab_repr;    /* Replacement for TAB characters */
     const char *end_marker;  /* Marker appended at end-of-line */
@@ -66,7 +305,19 @@ typedef struct {
 static const Options global_defaults = {
     .flag_num = 0, .flag_nnb = 0, .flag_squeeze = 0, .flag_ends = 0,
     .flag_tabs = 0, .flag_nonprinting = 0, .flag_follow = 0,
-    .squeeze_limit = 1,
+    .squeeze_limit = 1, .eol_mode = EOL_KEEP, .from_utf16 = UTF16_AUTO, .json_lines = 0,
+    .hex = 0, .range_start = 0, .range_end = -1,
+    .digest = 0, .digest_of = DIGEST_INPUT, .digest_file = NULL, .decompress = DECOMP_AUTO,
+    .compress = COMP_NONE, .match = NULL, .exclude = NULL, .match_len = 0, .exclude_len = 0,
+    .filter_after = 0, .count = 0, .sample_every = 0, .sample_rate = -1, .seed = -1,
+    .with_filename = 0, .uniq = 0, .uniq_count = 0, .dedupe = 0, .dedupe_memory = 256LL << 20,
+    .merge = 0,
+    .skew_ms = 500,
+    .watch_dir = NULL, .watch_pattern = "*", .max_open = 64,
+    .progress = 0, .auto_mode = 0,
+    .tee_count = 0, .tee_policy = TEE_BLOCK,
+    .framed = 0, .frame_seq = 0,
+    .max_line = 0, .max_line_chars = 0, .max_line_wrap = 0, .max_line_marker = 0,
     .line_format = "%6d\t", .tab_repr = "^I", .end_marker = "$"
 };
 
@@ -93,9 +344,70 @@ static void usage(void) {
         "  -s       suppress repeated blank lines\n"
         "  -e       display end-of-line marker (default \"$\")\n"
         "  -T       display TAB as \"^I\"\n"
-        "  -v       display nonprinting characters (except TAB and NL)\n"
+        "  -v       use ^ and M- notation for nonprinting characters (except TAB and NL)\n"
         "  -A       equivalent to -v -T -e\n"
         "  -f       follow file (continuously output appended data)\n"
+        "  --squeeze-limit=N  keep at most N consecutive blank lines (implies -s)\n"
+        "  --unix-eol         convert CRLF line endings to LF\n"
+        "  --dos-eol          convert LF line endings to CRLF\n"
+        "  --from-utf16[=le|be]  transcode UTF-16 input to UTF-8 (a BOM is detected\n"
+        "                     automatically whenever text is formatted)\n"
+        "  --json-lines[=object]  write each line as a JSON string, or as an object\n"
+        "                     {\"n\":N,\"line\":...} with its line number\n"
+        "  --hex              dump input as hex and ASCII (hexdump -C layout)\n"
+        "  --bytes=START-END  read only bytes START up to END of each input; either\n"
+        "                     may be omitted and take a K, M or G suffix\n"
+        "  --digest=ALG       hash data while copying; ALG is crc32c, xxh3 or sha256\n"
+        "  --digest-of=WHAT   hash each input, the output, or both (default input)\n"
+        "  --digest-file=PATH write digests to PATH instead of standard error\n"
+        "  --decompress       decode gzip/zstd input even without formatting options\n"
+        "  --no-decompress    never decode compressed input (it is detected by default\n"
+        "                     whenever text is formatted)\n"
+        "  --compress=ALG     compress the output; ALG is gzip or zstd\n"
+        "  --match=STR        output only lines containing the literal string STR\n"
+        "  --exclude=STR      leave out lines containing the literal string STR\n"
+        "  --filter-after     number and squeeze all lines, then filter (lines keep\n"
+        "                     their input line numbers)\n"
+        "  --with-filename[=basename]  start each line with the name of its file\n"
+        "                     (or its base name) and a colon\n"
+        "  --uniq[=count]     drop lines equal to the line before (=count: prefix each\n"
+        "                     line with the number of times it repeated, like uniq -c)\n"
+        "  --dedupe           drop lines seen anywhere before\n"
+        "  --dedupe-memory=SIZE  memory for exact --dedupe (default 256M); beyond it\n"
+        "                     lines are tracked approximately\n"
+        "  --merge[=FORMAT]   merge inputs that are each in time order into one\n"
+        "                     time-ordered stream; FORMAT is how lines start: iso\n"
+        "                     (YYYY-MM-DD HH:MM:SS[.frac], the default) or epoch\n"
+        "                     (with -f, follows every file and merges what is added)\n"
+        "  --skew=MS          with -f --merge, hold records back for up to MS\n"
+        "                     milliseconds (default 500) to put them in order\n"
+        "  --watch-dir=DIR    with -f, follow the files in DIR, including files created\n"
+        "                     later (read from their start); removed files are retired\n"
+        "  --pattern=GLOB     with --watch-dir, only files whose names match GLOB\n"
+        "  --max-open=N       with --watch-dir, keep at most N files open (default 64)\n"
+        "  --progress         show bytes read, throughput and time left on standard error\n"
+        "  --auto[=MODE]      format only inputs that look like text; binary ones (NULs\n"
+        "                     or invalid UTF-8 near the start) are copied as they\n"
+        "                     are (raw, the default) or dumped as with --hex (hex)\n"
+        "  --tee=PATH         also write the output to PATH (repeatable, up to 16)\n"
+        "  --tee-policy=P     what a --tee output that cannot keep up does: block\n"
+        "                     (the default: everything waits) or drop (it loses data)\n"
+        "  --framed[=ENC]     write each line without its newline as a binary record\n"
+        "                     after its length: varint (LEB128, the default) or u32\n"
+        "                     (little-endian)\n"
+        "  --frame-seq        with --framed, put the line number (u64, little-endian)\n"
+        "                     between each length and its line\n"
+        "  --max-line=N[c][,MODE][,marker]\n"
+        "                     cut lines to N bytes (or N UTF-8 characters with c)\n"
+        "                     without splitting characters; MODE truncate (the\n"
+        "                     default) drops the rest, ending the line in [+N bytes]\n"
+        "                     with marker, and wrap continues it on a new line\n"
+        "  --sample=1/N       output only every Nth line\n"
+        "  --sample-rate=P    output each line with probability P (0 to 1); line\n"
+        "                     numbers still count every input line\n"
+        "  --seed=S           random seed for --sample-rate (default: the clock)\n"
+        "  --count            print lines, nonblank lines, bytes and the longest line\n"
+        "                     of each input (and a total) instead of the contents\n"
         "  -h       display this help and exit\n"
         "  -V       output version information and exit\n"
     );
@@ -108,6 +420,7 @@ static void version(void) {
     printf("cc version 1.1\n");
 }
 
+#ifdef _WIN32
 /*
  * Retrieve file size in bytes.
  * Returns -1 on error (and logs a detailed error message).
@@ -121,313 +434,5417 @@ static long long get_file_size(const char *fname) {
     fclose(f);
     return size;
 }
+#endif
+
+/* Digest state for --digest; one per input file, plus one for the output */
+typedef struct {
+    int alg;                     /* DIGEST_CRC32C, DIGEST_XXH3 or DIGEST_SHA256 */
+    unsigned long long total;    /* Bytes hashed so far */
+    uint32_t crc;                /* CRC32C register */
+    uint32_t h[8];               /* SHA-256 chaining value */
+    uint64_t acc[8];             /* XXH3 accumulators */
+    size_t stripes;              /* XXH3 stripes consumed in the current block */
+    unsigned char buf[256];      /* Pending input: one SHA-256 block, or the XXH3 internal buffer */
+    size_t buf_len;
+} Digest;
+
+/* Default XXH3 secret (XXH3_kSecret) */
+static const unsigned char xxh3_secret[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint32_t read_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t read_le64(const unsigned char *p) {
+    return (uint64_t)read_le32(p) | (uint64_t)read_le32(p + 4) << 32;
+}
+
+/* Low and high halves of the 128-bit product a * b, xored together */
+static uint64_t mul128_fold64(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 r = (unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF), hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32), hi_hi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    return ((cross << 32) | (lo_lo & 0xFFFFFFFF)) ^ upper;
+#endif
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+    h ^= h >> 33; h *= XXH_PRIME64_2;
+    h ^= h >> 29; h *= XXH_PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+static uint64_t xxh3_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+static uint64_t xxh3_mix16(const unsigned char *p, const unsigned char *s) {
+    return mul128_fold64(read_le64(p) ^ read_le64(s), read_le64(p + 8) ^ read_le64(s + 8));
+}
 
 /*
- * Process a single line with optional formatting.
- * Uses a fast path when no transformations are requested.
+ * One-shot XXH3-64 (seed 0) of inputs up to 240 bytes, which the streaming
+ * state keeps whole in its buffer.
  */
-static inline void process_line_buffer(const char *line, size_t len, Options *opts, int *line_no) {
-    int is_blank = (len == 1 && line[0] == '\n');
-    if (opts->flag_num || (opts->flag_nnb && !is_blank))
-        printf(opts->line_format, (*line_no)++);
-
-    if (!opts->flag_tabs && !opts->flag_nonprinting && !opts->flag_ends) {
-        if (fwrite(line, 1, len, stdout) != len)
-            log_error("fwrite failed in fast path", 0);
-        return;
+static uint64_t xxh3_short(const unsigned char *p, size_t n) {
+    const unsigned char *s = xxh3_secret;
+    if (n == 0)
+        return xxh64_avalanche(read_le64(s + 56) ^ read_le64(s + 64));
+    if (n <= 3) {
+        uint32_t c = (uint32_t)p[0] << 16 | (uint32_t)p[n >> 1] << 24 | p[n - 1] | (uint32_t)n << 8;
+        return xxh64_avalanche(c ^ (uint64_t)(read_le32(s) ^ read_le32(s + 4)));
     }
-    for (size_t i = 0; i < len; i++) {
-        unsigned char c = (unsigned char)line[i];
-        if (c == '\t' && opts->flag_tabs)
-            fputs(opts->tab_repr, stdout);
-        else if (c == '\n') {
-            if (opts->flag_ends)
-                fputs(opts->end_marker, stdout);
-            putchar('\n');
-        } else if (opts->flag_nonprinting && (c < 32 || c == 127)) {
-            if (c == 127)
-                fputs("^?", stdout);
-            else { putchar('^'); putchar(c + 64); }
-        } else {
-            putchar(c);
+    if (n <= 8) {
+        uint64_t v = read_le32(p + n - 4) + ((uint64_t)read_le32(p) << 32);
+        uint64_t h = v ^ (read_le64(s + 8) ^ read_le64(s + 16));
+        h ^= ((h << 49) | (h >> 15)) ^ ((h << 24) | (h >> 40));
+        h *= 0x9FB21C651E98DF25ULL;
+        h ^= (h >> 35) + n;
+        h *= 0x9FB21C651E98DF25ULL;
+        return h ^ (h >> 28);
+    }
+    if (n <= 16) {
+        uint64_t lo = read_le64(p) ^ (read_le64(s + 24) ^ read_le64(s + 32));
+        uint64_t hi = read_le64(p + n - 8) ^ (read_le64(s + 40) ^ read_le64(s + 48));
+        uint64_t lo_swapped = 0;
+        for (int i = 0; i < 8; i++)
+            lo_swapped = lo_swapped << 8 | ((lo >> (8 * i)) & 0xFF);
+        return xxh3_avalanche(n + lo_swapped + hi + mul128_fold64(lo, hi));
+    }
+    uint64_t acc = n * XXH_PRIME64_1;
+    if (n <= 128) {
+        if (n > 32) {
+            if (n > 64) {
+                if (n > 96) {
+                    acc += xxh3_mix16(p + 48, s + 96);
+                    acc += xxh3_mix16(p + n - 64, s + 112);
+                }
+                acc += xxh3_mix16(p + 32, s + 64);
+                acc += xxh3_mix16(p + n - 48, s + 80);
+            }
+            acc += xxh3_mix16(p + 16, s + 32);
+            acc += xxh3_mix16(p + n - 32, s + 48);
         }
+        acc += xxh3_mix16(p, s);
+        acc += xxh3_mix16(p + n - 16, s + 16);
+        return xxh3_avalanche(acc);
     }
+    for (size_t i = 0; i < 8; i++)
+        acc += xxh3_mix16(p + 16 * i, s + 16 * i);
+    acc = xxh3_avalanche(acc);
+    for (size_t i = 8; i < n / 16; i++)
+        acc += xxh3_mix16(p + 16 * i, s + 16 * (i - 8) + 3);
+    acc += xxh3_mix16(p + n - 16, s + 136 - 17);
+    return xxh3_avalanche(acc);
 }
 
-/*
- * Process a text file line by line.
- */
-static void process_text(const char *fname, Options *opts, int *line_no) {
-    FILE *f = (strcmp(fname, "-") ? fopen(fname, "r") : stdin);
-    if (!f) { log_error(fname, 0); return; }
-    char buf[BUFSIZE];
-    int blank_count = 0;
-    while (fgets(buf, sizeof(buf), f)) {
-        size_t len = strlen(buf);
-        int is_blank = (len == 1 && buf[0] == '\n');
-        if (opts->flag_squeeze) {
-            if (is_blank && ++blank_count > opts->squeeze_limit)
-                continue;
-            else if (!is_blank)
-                blank_count = 0;
-        }
-        process_line_buffer(buf, len, opts, line_no);
+/* Fold one 64-byte stripe into the XXH3 accumulators */
+static void xxh3_accumulate(uint64_t *acc, const unsigned char *p, const unsigned char *s) {
+#ifdef __SSE2__
+    for (int i = 0; i < 4; i++) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + 2 * i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)(s + 16 * i)));
+        __m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+        a = _mm_add_epi64(a, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm_storeu_si128((__m128i *)(acc + 2 * i), _mm_add_epi64(a, prod));
     }
-    if (ferror(f))
-        log_error("Error reading file", 0);
-    if (f != stdin && fclose(f) != 0)
-        log_error("Failed to close file in process_text", 0);
+#else
+    for (int i = 0; i < 8; i++) {
+        uint64_t d = read_le64(p + 8 * i), dk = d ^ read_le64(s + 8 * i);
+        acc[i ^ 1] += d;
+        acc[i] += (dk & 0xFFFFFFFF) * (dk >> 32);
+    }
+#endif
 }
 
-/*
- * Process a file in binary mode with minimal overhead.
- */
-static void process_binary(const char *fname) {
-    FILE *f = (strcmp(fname, "-") ? fopen(fname, "rb") : stdin);
-    if (!f) { log_error(fname, 0); return; }
-    char buf[BUFSIZE];
-    size_t n;
-    while ((n = fread(buf, 1, BUFSIZE, f)) > 0) {
-        if (fwrite(buf, 1, n, stdout) != n) {
-            log_error("fwrite failed in process_binary", 0);
-            break;
+static void xxh3_scramble(uint64_t *acc, const unsigned char *s) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= read_le64(s + 8 * i);
+        acc[i] = a * XXH_PRIME32_1;
+    }
+}
+
+/* Consume n stripes, scrambling at every 1KB block boundary (16 stripes) */
+static void xxh3_stripes(uint64_t *acc, size_t *done, const unsigned char *p, size_t n) {
+    while (n--) {
+        xxh3_accumulate(acc, p, xxh3_secret + 8 * *done);
+        p += 64;
+        if (++*done == 16) {
+            xxh3_scramble(acc, xxh3_secret + 192 - 64);
+            *done = 0;
         }
     }
-    if (ferror(f))
-        log_error("Error reading binary file", 0);
-    if (f != stdin && fclose(f) != 0)
-        log_error("Failed to close file in process_binary", 0);
 }
 
-#ifdef _WIN32
-/*
- * Process file using memory mapping on Windows.
- */
-static void process_file_mmap(const char *fname, int text_mode, Options *opts, int *line_no) {
-    HANDLE hFile = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
-    if (hFile == INVALID_HANDLE_VALUE) { log_error("Error opening file", 0); return; }
-    LARGE_INTEGER fsize;
-    if (!GetFileSizeEx(hFile, &fsize)) { log_error("GetFileSizeEx failed", 0); CloseHandle(hFile); return; }
-    if (fsize.QuadPart == 0) { CloseHandle(hFile); return; }
-    HANDLE hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
-    if (!hMap) { log_error("CreateFileMapping failed", 0); CloseHandle(hFile); return; }
-    char *data = (char*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
-    if (!data) { log_error("MapViewOfFile failed", 0); CloseHandle(hMap); CloseHandle(hFile); return; }
-    size_t size = (size_t)fsize.QuadPart;
-    if (!text_mode) {
-        if (fwrite(data, 1, size, stdout) != size)
-            log_error("fwrite failed in mmap binary mode", 0);
+static void xxh3_update(Digest *d, const unsigned char *p, size_t n) {
+    /* The buffer is only consumed once more input follows, so the final
+     * stripe is always left for xxh3_digest */
+    if (d->buf_len + n <= sizeof(d->buf)) {
+        memcpy(d->buf + d->buf_len, p, n);
+        d->buf_len += n;
+        return;
+    }
+    if (d->buf_len) {
+        size_t fill = sizeof(d->buf) - d->buf_len;
+        memcpy(d->buf + d->buf_len, p, fill);
+        p += fill;
+        n -= fill;
+        xxh3_stripes(d->acc, &d->stripes, d->buf, sizeof(d->buf) / 64);
+        d->buf_len = 0;
+    }
+    if (n > sizeof(d->buf)) {
+        do {
+            xxh3_stripes(d->acc, &d->stripes, p, sizeof(d->buf) / 64);
+            p += sizeof(d->buf);
+            n -= sizeof(d->buf);
+        } while (n > sizeof(d->buf));
+        /* A short final stripe reaches back into the last one consumed */
+        memcpy(d->buf + sizeof(d->buf) - 64, p - 64, 64);
+    }
+    memcpy(d->buf, p, n);
+    d->buf_len = n;
+}
+
+static uint64_t xxh3_digest(const Digest *d) {
+    if (d->total <= 240)
+        return xxh3_short(d->buf, d->buf_len);
+    uint64_t acc[8];
+    size_t done = d->stripes;
+    unsigned char last[64];
+    memcpy(acc, d->acc, sizeof(acc));
+    if (d->buf_len >= 64) {
+        xxh3_stripes(acc, &done, d->buf, (d->buf_len - 1) / 64);
+        memcpy(last, d->buf + d->buf_len - 64, 64);
     } else {
-        int blank_count = 0;
-        size_t i = 0;
-        while (i < size) {
-            size_t ls = i;
-            while (i < size && data[i] != '\n') i++;
-            if (i < size && data[i] == '\n') i++;
-            size_t ll = i - ls;
-            if (opts->flag_squeeze && (ll == 1 && data[ls] == '\n')) {
-                if (++blank_count > opts->squeeze_limit)
-                    continue;
-            } else {
-                blank_count = 0;
+        /* The last stripe reaches back into bytes already consumed */
+        memcpy(last, d->buf + sizeof(d->buf) - (64 - d->buf_len), 64 - d->buf_len);
+        memcpy(last + 64 - d->buf_len, d->buf, d->buf_len);
+    }
+    xxh3_accumulate(acc, last, xxh3_secret + 192 - 64 - 7);
+    uint64_t h = d->total * XXH_PRIME64_1;
+    for (int i = 0; i < 4; i++)
+        h += mul128_fold64(acc[2 * i] ^ read_le64(xxh3_secret + 11 + 16 * i),
+                           acc[2 * i + 1] ^ read_le64(xxh3_secret + 11 + 16 * i + 8));
+    return xxh3_avalanche(h);
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/* Compress n 64-byte blocks into the SHA-256 state */
+static void sha256_blocks(uint32_t *h, const unsigned char *p, size_t n) {
+#if defined(__SHA__) && defined(__SSE4_1__)
+    /* SHA-NI: state kept as ABEF/CDGH, four rounds per sha256rnds2 pair */
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0xB1);
+    __m128i st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(h + 4)), 0x1B);
+    __m128i st0 = _mm_alignr_epi8(tmp, st1, 8);
+    st1 = _mm_blend_epi16(st1, tmp, 0xF0);
+    for (; n; n--, p += 64) {
+        __m128i save0 = st0, save1 = st1, m[4];
+        for (int j = 0; j < 16; j++) {
+            if (j < 4)
+                m[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * j)), bswap);
+            __m128i msg = _mm_add_epi32(m[j & 3], _mm_loadu_si128((const __m128i *)(sha256_k + 4 * j)));
+            st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+            if (j >= 3 && j < 15) {
+                __m128i next = _mm_add_epi32(m[(j + 1) & 3], _mm_alignr_epi8(m[j & 3], m[(j - 1) & 3], 4));
+                m[(j + 1) & 3] = _mm_sha256msg2_epu32(next, m[j & 3]);
             }
-            process_line_buffer(data + ls, ll, opts, line_no);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(msg, 0x0E));
+            if (j >= 1 && j < 13)
+                m[(j - 1) & 3] = _mm_sha256msg1_epu32(m[(j - 1) & 3], m[j & 3]);
         }
+        st0 = _mm_add_epi32(st0, save0);
+        st1 = _mm_add_epi32(st1, save1);
     }
-    UnmapViewOfFile(data);
-    CloseHandle(hMap);
-    CloseHandle(hFile);
-}
+    tmp = _mm_shuffle_epi32(st0, 0x1B);
+    st1 = _mm_shuffle_epi32(st1, 0xB1);
+    _mm_storeu_si128((__m128i *)h, _mm_blend_epi16(tmp, st1, 0xF0));
+    _mm_storeu_si128((__m128i *)(h + 4), _mm_alignr_epi8(st1, tmp, 8));
 #else
-/*
- * Process file using memory mapping on POSIX systems.
- */
-static void process_file_mmap(const char *fname, int text_mode, Options *opts, int *line_no) {
-    int fd = open(fname, O_RDONLY);
-    if (fd < 0) { log_error(fname, 0); return; }
-    struct stat st;
-    if (fstat(fd, &st) < 0) { log_error("fstat failed", 0); close(fd); return; }
-    if (st.st_size == 0) { close(fd); return; }
-    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (data == MAP_FAILED) { log_error("mmap failed", 0); close(fd); return; }
-    size_t size = st.st_size;
-    if (!text_mode) {
-        if (fwrite(data, 1, size, stdout) != size)
-            log_error("fwrite failed in mmap binary mode", 0);
-    } else {
-        int blank_count = 0;
-        size_t i = 0;
-        while (i < size) {
-            size_t ls = i;
-            while (i < size && data[i] != '\n') i++;
-            if (i < size && data[i] == '\n') i++;
-            size_t ll = i - ls;
-            if (opts->flag_squeeze && (ll == 1 && data[ls] == '\n')) {
-                if (++blank_count > opts->squeeze_limit)
-                    continue;
-            } else {
-                blank_count = 0;
-            }
-            process_line_buffer(data + ls, ll, opts, line_no);
+    #define ROR(x, r) ((x) >> (r) | (x) << (32 - (r)))
+    for (; n; n--, p += 64) {
+        uint32_t w[64], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        for (int i = 16; i < 64; i++)
+            w[i] = w[i - 16] + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+                   w[i - 7] + (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            k = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
         }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+    }
+    #undef ROR
+#endif
+}
+
+static void sha256_update(Digest *d, const unsigned char *p, size_t n) {
+    if (d->buf_len) {
+        size_t fill = (64 - d->buf_len < n) ? 64 - d->buf_len : n;
+        memcpy(d->buf + d->buf_len, p, fill);
+        d->buf_len += fill;
+        p += fill;
+        n -= fill;
+        if (d->buf_len < 64)
+            return;
+        sha256_blocks(d->h, d->buf, 1);
+        d->buf_len = 0;
     }
-    if (munmap(data, st.st_size) < 0)
-        log_error("munmap failed", 0);
-    if (close(fd) < 0)
-        log_error("close failed for mmap file", 0);
+    sha256_blocks(d->h, p, n / 64);
+    memcpy(d->buf, p + (n & ~(size_t)63), n & 63);
+    d->buf_len = n & 63;
 }
+
+#ifndef CC_HW_CRC32C
+/* Reflected CRC32C (Castagnoli) table, built by digest_init */
+static uint32_t crc32c_table[256];
 #endif
 
-/* Global flag for follow mode termination */
-static volatile sig_atomic_t stop_follow = 0;
+static void crc32c_update(Digest *d, const unsigned char *p, size_t n) {
+    uint32_t c = d->crc;
+#ifdef CC_HW_CRC32C
+    uint64_t c64 = c;
+    for (; n >= 8; p += 8, n -= 8)
+        c64 = _mm_crc32_u64(c64, read_le64(p));
+    c = (uint32_t)c64;
+    for (; n; p++, n--)
+        c = _mm_crc32_u8(c, *p);
+#else
+    for (; n; p++, n--)
+        c = crc32c_table[(c ^ *p) & 0xFF] ^ (c >> 8);
+#endif
+    d->crc = c;
+}
+
+static void digest_init(Digest *d, int alg) {
+    static const uint32_t sha256_iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    static const uint64_t xxh3_iv[8] = {
+        XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+        XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1
+    };
+    memset(d, 0, sizeof(*d));
+    d->alg = alg;
+    d->crc = 0xFFFFFFFF;
+    memcpy(d->h, sha256_iv, sizeof(d->h));
+    memcpy(d->acc, xxh3_iv, sizeof(d->acc));
+#ifndef CC_HW_CRC32C
+    if (alg == DIGEST_CRC32C && !crc32c_table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+            crc32c_table[i] = c;
+        }
+    }
+#endif
+}
+
+static void digest_update(Digest *d, const void *data, size_t n) {
+    const unsigned char *p = data;
+    d->total += n;
+    if (d->alg == DIGEST_CRC32C)
+        crc32c_update(d, p, n);
+    else if (d->alg == DIGEST_XXH3)
+        xxh3_update(d, p, n);
+    else if (d->alg == DIGEST_SHA256)
+        sha256_update(d, p, n);
+}
 
 /*
- * Signal handler for graceful termination (e.g., on SIGINT).
+ * Finish a copy of the digest into lowercase hex (at most 64 digits + NUL);
+ * d itself is left untouched.
  */
-static void handle_sigint(int sig) {
-    (void)sig; /* Unused parameter */
-    stop_follow = 1;
+static void digest_hex(const Digest *d, char *hex) {
+    if (d->alg == DIGEST_CRC32C) {
+        sprintf(hex, "%08x", (unsigned)(d->crc ^ 0xFFFFFFFF));
+    } else if (d->alg == DIGEST_XXH3) {
+        sprintf(hex, "%016llx", (unsigned long long)xxh3_digest(d));
+    } else {
+        Digest s = *d;
+        unsigned char pad[128] = { 0x80 };
+        size_t padlen = (s.buf_len < 56) ? 56 - s.buf_len : 120 - s.buf_len;
+        uint64_t bits = d->total * 8;
+        for (int i = 0; i < 8; i++)
+            pad[padlen + i] = (unsigned char)(bits >> (56 - 8 * i));
+        sha256_update(&s, pad, padlen + 8);
+        for (int i = 0; i < 8; i++)
+            sprintf(hex + 8 * i, "%08x", (unsigned)s.h[i]);
+    }
 }
 
 /*
- * Follow mode processing (tail -f style) for text files.
- * This loop now checks for SIGINT to allow graceful exit.
+ * Output layer. Everything cc writes to standard output goes through
+ * out_write, out_putc and out_printf, so an output digest sees the exact
+ * byte stream. out_tap is set while such a digest runs, and out_comp while
+ * --compress runs; kernel-side copies must then either be avoided or (for a
+ * digest) hash their data themselves.
  */
-static void process_follow_text(const char *fname, Options *opts, int *line_no) {
-    FILE *f = fopen(fname, "r");
-    if (!f) { log_error(fname, 0); return; }
-    if (fseek(f, 0, SEEK_END) != 0) { log_error("Initial fseek failed in follow mode", 0); fclose(f); return; }
-    long current_offset = ftell(f);
-    if (current_offset < 0) { log_error("Initial ftell failed in follow mode", 0); fclose(f); return; }
+static int out_tap = 0;
+static Digest out_digest;
+static int out_comp = 0;
 
-    /* Register signal handler for graceful termination */
-    #ifndef _WIN32
-    signal(SIGINT, handle_sigint);
-    #endif
+/*
+ * --tee: more outputs that get exactly what standard output gets. While any
+ * are open, output bypasses stdio: sink_write gathers it in one buffer that
+ * is written to standard output and to every tee, and copy_fd_zerocopy fans
+ * out inside the kernel with tee(2). With TEE_DROP the tees are non-blocking
+ * and a tee that is full loses what did not fit (possibly part of a line);
+ * the losses are reported at exit. Standard output itself always blocks.
+ * SIGPIPE is ignored while tees are open: a tee whose reader goes away is
+ * retired (fd -1) and everything after that counts as dropped, while
+ * standard output going away still ends cc as SIGPIPE would.
+ */
+static struct {
+    int count, policy;
+    int fd[TEE_MAX];
+    const char *path[TEE_MAX];
+    long long dropped[TEE_MAX];
+    char buf[TEE_BUF];
+    size_t len;
+} tee_out;
 
-    char buf[BUFSIZE];
-    while (!stop_follow) {
-        struct stat st;
-        if (stat(fname, &st) < 0) {
-            log_error("stat failed in follow mode", 0);
+#ifndef _WIN32
+/* Standard output's reader went away while SIGPIPE was ignored for the tees */
+static void stdout_closed(void) {
+    signal(SIGPIPE, SIG_DFL);
+    raise(SIGPIPE);
+}
+#endif
+
+/*
+ * Write p[0..n) to fd. Returns how much was written: all of it unless the
+ * write failed (errno is EPIPE if the reader went away), or fd is
+ * non-blocking, full and droppable.
+ */
+static size_t write_fd(int fd, const char *p, size_t n, int droppable) {
+    size_t done = 0;
+    while (done < n) {
 #ifdef _WIN32
-            Sleep(1000);
+        int k = _write(fd, p + done, (unsigned)(n - done));
 #else
-            sleep(1);
-#endif
+        ssize_t k = write(fd, p + done, n - done);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k < 0 && errno == EAGAIN && !droppable) {
+            struct pollfd w = { .fd = fd, .events = POLLOUT };
+            poll(&w, 1, -1);
             continue;
         }
-        if (st.st_size > (size_t)current_offset) {
-            if (fseek(f, current_offset, SEEK_SET) != 0) {
-                log_error("fseek failed in follow mode", 0);
-                break;
-            }
-            while (fgets(buf, sizeof(buf), f)) {
-                size_t len = strlen(buf);
-                current_offset = ftell(f);
-                process_line_buffer(buf, len, opts, line_no);
-            }
-            if (ferror(f))
-                log_error("Error reading in follow mode", 0);
+        if (k < 0 && errno == EAGAIN)
+            break;
+        if (k < 0 && errno == EPIPE) {
+            if (fd == STDOUT_FILENO)
+                stdout_closed();
+            break;
         }
-#ifdef _WIN32
-        Sleep(1000);
-#else
-        sleep(1);
 #endif
-    }
-    fclose(f);
-}
-
-/*
- * Parse command-line flags and collect file names.
- * Exits immediately on allocation or parsing errors.
- */
-static int parse_global_flags(int argc, char *argv[], Options *opts, char ***file_list) {
-    int fileCount = 0, parsing_flags = 1;
-    char **files = malloc(sizeof(char*) * argc);
-    if (!files) { log_error("malloc failed in parse_global_flags", 1); }
-    for (int i = 1; i < argc; i++) {
-        char *arg = argv[i];
-        if (parsing_flags && strcmp(arg, "--") == 0) { parsing_flags = 0; continue; }
-        if (parsing_flags && arg[0] == '-' && arg[1]) {
-            if (arg[0] == '-' && arg[1] == '-') {
-                if (!strcmp(arg, "--help")) { usage(); exit(EXIT_SUCCESS); }
-                else if (!strcmp(arg, "--version")) { version(); exit(EXIT_SUCCESS); }
-                else { fprintf(stderr, "Unknown option: %s\n", arg); exit(EXIT_FAILURE); }
-            } else {
-                for (int j = 1; arg[j]; j++) {
-                    switch(arg[j]) {
-                        case 'n': opts->flag_num = 1; break;
-                        case 'b': opts->flag_nnb = 1; break;
-                        case 's': opts->flag_squeeze = 1; break;
-                        case 'e': opts->flag_ends = 1; break;
-                        case 'T': opts->flag_tabs = 1; break;
-                        case 'v': opts->flag_nonprinting = 1; break;
-                        case 'A': opts->flag_nonprinting = opts->flag_tabs = opts->flag_ends = 1; break;
-                        case 'f': opts->flag_follow = 1; break;
-                        case 'h': usage(); exit(EXIT_SUCCESS);
-                        case 'V': version(); exit(EXIT_SUCCESS);
-                        default:
-                            fprintf(stderr, "Unknown flag: -%c\n", arg[j]);
-                            exit(EXIT_FAILURE);
-                    }
-                }
-            }
-        } else {
-            files[fileCount++] = arg;
+        if (k <= 0) {
+            log_error("write failed", 0);
+            break;
         }
+        done += (size_t)k;
     }
-    if (fileCount == 0)
-        files[fileCount++] = "-";
-    *file_list = files;
-    return fileCount;
+    return done;
 }
 
-/*
- * Main entry point.
- * Determines processing mode (text, binary, follow, or memory mapping) and handles each file.
- * If no file is specified and STDIN is interactive, usage is printed to avoid hanging.
- */
-int main(int argc, char *argv[]) {
+/* The reader of tee i went away: it gets nothing more */
+static void tee_retire(int i) {
 #ifdef _WIN32
-    SetConsoleOutputCP(CP_UTF8);
-    // _setmode(_fileno(stdout), _O_BINARY); // Uncomment if binary output is needed
+    _close(tee_out.fd[i]);
+#else
+    close(tee_out.fd[i]);
 #endif
-    setvbuf(stdout, NULL, _IOFBF, BUFSIZE);
-    Options opts = global_defaults;
-    char **files;
-    int fileCount = parse_global_flags(argc, argv, &opts, &files);
+    tee_out.fd[i] = -1;
+}
 
-    /* If running interactively with no file redirection, show usage instead of hanging */
-    if (fileCount == 1 && strcmp(files[0], "-") == 0) {
+/* Write p[0..n) to standard output and to every tee */
+static void tee_write(const char *p, size_t n) {
 #ifdef _WIN32
-        if (_isatty(_fileno(stdin))) { usage(); free(files); return EXIT_SUCCESS; }
+    write_fd(_fileno(stdout), p, n, 0);
 #else
-        if (isatty(fileno(stdin))) { usage(); free(files); return EXIT_SUCCESS; }
+    write_fd(STDOUT_FILENO, p, n, 0);
 #endif
-    }
-
-    int use_text = (opts.flag_num || opts.flag_nnb || opts.flag_squeeze ||
-                    opts.flag_ends || opts.flag_tabs || opts.flag_nonprinting);
-    int line_no = 1;
-    for (int i = 0; i < fileCount; i++) {
-        const char *fname = files[i];
-        if (opts.flag_follow && strcmp(fname, "-") != 0) {
-            process_follow_text(fname, &opts, &line_no);
+    for (int i = 0; i < tee_out.count; i++) {
+        if (tee_out.fd[i] < 0) {
+            tee_out.dropped[i] += (long long)n;
             continue;
         }
-        int use_mmap_local = (strcmp(fname, "-") && (get_file_size(fname) >= MMAP_THRESHOLD));
-        if (use_mmap_local) {
-            process_file_mmap(fname, use_text, &opts, &line_no);
-        } else {
-            if (use_text)
-                process_text(fname, &opts, &line_no);
-            else
-                process_binary(fname);
-        }
+        size_t k = write_fd(tee_out.fd[i], p, n, tee_out.policy == TEE_DROP);
+        tee_out.dropped[i] += (long long)(n - k);
+        if (k < n && errno == EPIPE)
+            tee_retire(i);
     }
-    free(files);
-    fflush(stdout);
+}
+
+/* Write out the buffer shared by standard output and the tees */
+static void tee_flush(void) {
+    if (tee_out.len)
+        tee_write(tee_out.buf, tee_out.len);
+    tee_out.len = 0;
+}
+
+/* Bytes as they leave cc: hashed for --digest-of=output, then written */
+static size_t sink_write(const void *p, size_t n) {
+    if (out_tap)
+        digest_update(&out_digest, p, n);
+    if (!tee_out.count)
+        return fwrite(p, 1, n, stdout);
+    if (tee_out.len + n > TEE_BUF)
+        tee_flush();
+    if (n >= TEE_BUF) {
+        /* Too big to gather: written out from where it is */
+        tee_write(p, n);
+        return n;
+    }
+    memcpy(tee_out.buf + tee_out.len, p, n);
+    tee_out.len += n;
+    return n;
+}
+
+#ifdef CC_HAVE_COMPRESS
+/*
+ * --compress. The output is cut into COMP_BLOCK blocks that are compressed
+ * independently into complete gzip members or zstd frames, so the result is
+ * an ordinary multi-member (multi-frame) stream any decoder accepts. A pool
+ * of worker threads compresses the blocks while the engines fill the next
+ * ones; finished blocks are written in order by the thread producing output.
+ * Without threads each block is compressed as soon as it is full.
+ */
+typedef struct {
+    char *in, *out;
+    size_t in_len, out_len, out_cap;
+    int done, ok;
+} CompBlock;
+
+static struct {
+    int kind, level;
+    CompBlock *blk;
+    int nslots, nthreads;
+    unsigned long long submitted, taken, written; /* Block sequence numbers */
+    int any, quit;
+    void *ctx;                  /* Compression context when there are no workers */
+#ifndef _WIN32
+    pthread_mutex_t lock;
+    pthread_cond_t work, ready;
+    pthread_t tid[COMP_THREADS];
+#endif
+} comp;
+
+/* Compress one block into b->out; *ctx caches a zstd context between calls */
+static void comp_block(CompBlock *b, void **ctx) {
+    size_t bound = 0;
+#ifdef CC_HAVE_ZLIB
+    z_stream z;
+    if (comp.kind == COMP_GZIP) {
+        memset(&z, 0, sizeof(z));
+        if (deflateInit2(&z, comp.level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return;
+        bound = deflateBound(&z, (uLong)b->in_len);
+    }
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (comp.kind == COMP_ZSTD)
+        bound = ZSTD_compressBound(b->in_len);
+#endif
+    if (b->out_cap < bound) {
+        char *out = realloc(b->out, bound);
+        if (out) {
+            b->out = out;
+            b->out_cap = bound;
+        }
+    }
+#ifdef CC_HAVE_ZLIB
+    if (comp.kind == COMP_GZIP) {
+        z.next_in = (Bytef *)b->in;
+        z.avail_in = (uInt)b->in_len;
+        z.next_out = (Bytef *)b->out;
+        z.avail_out = (uInt)b->out_cap;
+        b->ok = (b->out_cap >= bound && deflate(&z, Z_FINISH) == Z_STREAM_END);
+        b->out_len = z.total_out;
+        deflateEnd(&z);
+    }
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (comp.kind == COMP_ZSTD) {
+        if (!*ctx)
+            *ctx = ZSTD_createCCtx();
+        size_t r = (*ctx && b->out_cap >= bound)
+            ? ZSTD_compressCCtx(*ctx, b->out, b->out_cap, b->in, b->in_len, comp.level) : 0;
+        b->ok = (r && !ZSTD_isError(r));
+        b->out_len = b->ok ? r : 0;
+    }
+#endif
+    (void)ctx;
+}
+
+static void comp_free_ctx(void *ctx) {
+#ifdef CC_HAVE_ZSTD
+    ZSTD_freeCCtx(ctx);
+#else
+    (void)ctx;
+#endif
+}
+
+#ifndef _WIN32
+static void *comp_worker(void *arg) {
+    void *ctx = NULL;
+    (void)arg;
+    pthread_mutex_lock(&comp.lock);
+    for (;;) {
+        while (comp.taken == comp.submitted && !comp.quit)
+            pthread_cond_wait(&comp.work, &comp.lock);
+        if (comp.taken == comp.submitted)
+            break;
+        CompBlock *b = &comp.blk[comp.taken++ % (unsigned)comp.nslots];
+        pthread_mutex_unlock(&comp.lock);
+        comp_block(b, &ctx);
+        pthread_mutex_lock(&comp.lock);
+        b->done = 1;
+        pthread_cond_broadcast(&comp.ready);
+    }
+    pthread_mutex_unlock(&comp.lock);
+    comp_free_ctx(ctx);
+    return NULL;
+}
+#endif
+
+/*
+ * Set up --compress with one worker per CPU (none on a single CPU or on
+ * Windows) and twice as many blocks. Exits if memory runs out.
+ */
+static void comp_start(int kind) {
+    comp.kind = kind;
+#ifdef CC_HAVE_ZLIB
+    if (kind == COMP_GZIP)
+        comp.level = Z_DEFAULT_COMPRESSION;
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (kind == COMP_ZSTD)
+        comp.level = ZSTD_CLEVEL_DEFAULT;
+#endif
+    long ncpu = 1;
+#ifndef _WIN32
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    int nthreads = (ncpu > COMP_THREADS) ? COMP_THREADS : (ncpu < 2) ? 0 : (int)ncpu;
+    comp.nslots = nthreads ? 2 * nthreads : 1;
+    if (!(comp.blk = calloc((size_t)comp.nslots, sizeof(CompBlock))))
+        log_error("malloc failed for --compress", 1);
+    for (int i = 0; i < comp.nslots; i++)
+        if (!(comp.blk[i].in = malloc(COMP_BLOCK)))
+            log_error("malloc failed for --compress", 1);
+#ifndef _WIN32
+    pthread_mutex_init(&comp.lock, NULL);
+    pthread_cond_init(&comp.work, NULL);
+    pthread_cond_init(&comp.ready, NULL);
+    while (comp.nthreads < nthreads &&
+           pthread_create(&comp.tid[comp.nthreads], NULL, comp_worker, NULL) == 0)
+        comp.nthreads++;
+#endif
+    out_comp = 1;
+}
+
+/*
+ * Write finished blocks in order. Waits for the oldest block when all is set
+ * or when every block is in flight, so the next one to fill is always free.
+ */
+static void comp_drain(int all) {
+    while (comp.written < comp.submitted) {
+        CompBlock *b = &comp.blk[comp.written % (unsigned)comp.nslots];
+#ifndef _WIN32
+        if (comp.nthreads) {
+            int wait = all || comp.submitted - comp.written == (unsigned)comp.nslots;
+            pthread_mutex_lock(&comp.lock);
+            while (wait && !b->done)
+                pthread_cond_wait(&comp.ready, &comp.lock);
+            int done = b->done;
+            pthread_mutex_unlock(&comp.lock);
+            if (!done)
+                return;
+        }
+#endif
+        if (!b->ok)
+            log_error("Compression failed", 1);
+        if (sink_write(b->out, b->out_len) != b->out_len)
+            log_error("fwrite failed for compressed output", 0);
+        b->in_len = 0;
+        b->done = 0;
+        comp.written++;
+    }
+}
+
+/* Hand the block being filled to the workers (or compress it here) */
+static void comp_submit(void) {
+    CompBlock *b = &comp.blk[comp.submitted % (unsigned)comp.nslots];
+#ifndef _WIN32
+    if (comp.nthreads) {
+        pthread_mutex_lock(&comp.lock);
+        comp.submitted++;
+        pthread_cond_signal(&comp.work);
+        pthread_mutex_unlock(&comp.lock);
+    } else
+#endif
+    {
+        comp_block(b, &comp.ctx);
+        b->done = 1;
+        comp.submitted++;
+    }
+    comp.any = 1;
+    comp_drain(0);
+}
+
+static size_t comp_write(const void *p, size_t n) {
+    const char *s = p;
+    size_t left = n;
+    while (left) {
+        CompBlock *b = &comp.blk[comp.submitted % (unsigned)comp.nslots];
+        size_t k = (left < COMP_BLOCK - b->in_len) ? left : COMP_BLOCK - b->in_len;
+        memcpy(b->in + b->in_len, s, k);
+        b->in_len += k;
+        s += k;
+        left -= k;
+        if (b->in_len == COMP_BLOCK)
+            comp_submit();
+    }
+    return n;
+}
+
+/*
+ * Compress and write everything buffered so far, ending the current member
+ * or frame early. With final set, an empty output still gets one (empty)
+ * member so it decodes, and the workers are stopped.
+ */
+static void comp_flush(int final) {
+    if (comp.blk[comp.submitted % (unsigned)comp.nslots].in_len || (final && !comp.any))
+        comp_submit();
+    comp_drain(1);
+    if (!final)
+        return;
+#ifndef _WIN32
+    pthread_mutex_lock(&comp.lock);
+    comp.quit = 1;
+    pthread_cond_broadcast(&comp.work);
+    pthread_mutex_unlock(&comp.lock);
+    for (int i = 0; i < comp.nthreads; i++)
+        pthread_join(comp.tid[i], NULL);
+#endif
+    comp_free_ctx(comp.ctx);
+    for (int i = 0; i < comp.nslots; i++) {
+        free(comp.blk[i].in);
+        free(comp.blk[i].out);
+    }
+    free(comp.blk);
+    out_comp = 0;
+}
+#endif
+
+/*
+ * Spans written as one writev (--with-filename gathers each prefix and line
+ * here rather than copying them together). The spans point into the caller's
+ * block, so they are written before it returns; any other output writes
+ * them first to keep the order. Spans into a mapped window of a file that
+ * was truncated make writev fail with EFAULT; that is left to the reader to
+ * tell from a real error (out_spans_faulted).
+ */
+#ifdef _WIN32
+struct iovec { void *iov_base; size_t iov_len; };
+#endif
+static struct iovec out_iov[SPAN_IOVS];
+static int out_iovcnt = 0;
+static int out_spans_faulted = 0;
+
+static void out_spans_flush(void) {
+    int cnt = out_iovcnt;
+    out_iovcnt = 0;
+#ifndef _WIN32
+    if (!out_tap && !out_comp && !tee_out.count) {
+        struct iovec *v = out_iov;
+        if (fflush(stdout) != 0) { log_error("fflush failed before writev", 0); return; }
+        while (cnt > 0) {
+            ssize_t n = writev(STDOUT_FILENO, v, cnt);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EFAULT) { out_spans_faulted = 1; return; }
+            if (n < 0) { log_error("writev failed", 0); return; }
+            while (cnt > 0 && (size_t)n >= v->iov_len) {
+                n -= (ssize_t)v->iov_len;
+                v++;
+                cnt--;
+            }
+            if (cnt > 0) {
+                v->iov_base = (char *)v->iov_base + n;
+                v->iov_len -= (size_t)n;
+            }
+        }
+        return;
+    }
+#endif
+    for (int i = 0; i < cnt; i++) {
+#ifdef CC_HAVE_COMPRESS
+        if (out_comp) {
+            comp_write(out_iov[i].iov_base, out_iov[i].iov_len);
+            continue;
+        }
+#endif
+        sink_write(out_iov[i].iov_base, out_iov[i].iov_len);
+    }
+}
+
+static void out_span(const void *p, size_t n) {
+    if (out_iovcnt == SPAN_IOVS)
+        out_spans_flush();
+    out_iov[out_iovcnt].iov_base = (void *)p;
+    out_iov[out_iovcnt++].iov_len = n;
+}
+
+static size_t out_write(const void *p, size_t n) {
+    if (out_iovcnt)
+        out_spans_flush();
+#ifdef CC_HAVE_COMPRESS
+    if (out_comp)
+        return comp_write(p, n);
+#endif
+    return sink_write(p, n);
+}
+
+static void out_putc(char c) {
+    if (out_iovcnt)
+        out_spans_flush();
+#ifdef CC_HAVE_COMPRESS
+    if (out_comp) {
+        comp_write(&c, 1);
+        return;
+    }
+#endif
+    if (tee_out.count) {
+        sink_write(&c, 1);
+        return;
+    }
+    if (out_tap)
+        digest_update(&out_digest, &c, 1);
+    putchar(c);
+}
+
+static void out_printf(const char *fmt, ...) {
+    char buf[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        out_write(buf, ((size_t)n < sizeof(buf)) ? (size_t)n : sizeof(buf) - 1);
+}
+
+/* Push buffered output out now; --compress also ends its current member or frame */
+static void out_flush(void) {
+#ifdef CC_HAVE_COMPRESS
+    if (out_comp)
+        comp_flush(0);
+#endif
+    tee_flush();
+    fflush(stdout);
+}
+
+/* Milliseconds from an arbitrary start, for --progress and the -f --merge skew window */
+static long long now_ms(void) {
+#ifdef _WIN32
+    return (long long)GetTickCount64();
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+#endif
+}
+
+static void sleep_ms(long ms) {
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec t = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&t, NULL);
+#endif
+}
+
+/*
+ * --progress: the engines add the input bytes they consume to an atomic
+ * counter, one relaxed add per block, and a timer thread prints bytes done,
+ * throughput and ETA to stderr four times a second. The total is the sum of
+ * the inputs' sizes, or 0 when some size is unknown (pipes, -f).
+ */
+static struct {
+    int on;
+    long long done, total;
+    long long start_ms, last_ms, last_done;
+    double rate;                /* Smoothed bytes per second */
+    int stop, started;
+    long long end_ms;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+} progress;
+
+static void progress_add(size_t n) {
+    if (progress.on)
+        __atomic_fetch_add(&progress.done, (long long)n, __ATOMIC_RELAXED);
+}
+
+/* Format a byte count with a binary unit, e.g. "1.5 GiB" */
+static const char *human_size(char *buf, size_t cap, double v) {
+    static const char *unit[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+    int u = 0;
+    while (v >= 1024 && u < 5) {
+        v /= 1024;
+        u++;
+    }
+    snprintf(buf, cap, u ? "%.1f %s" : "%.0f %s", v, unit[u]);
+    return buf;
+}
+
+static void progress_print(int final) {
+    long long now = final ? progress.end_ms : now_ms();
+    long long done = __atomic_load_n(&progress.done, __ATOMIC_RELAXED);
+    if (now > progress.last_ms) {
+        double rate = (double)(done - progress.last_done) * 1000.0 / (double)(now - progress.last_ms);
+        progress.rate = progress.last_done || progress.rate ? 0.7 * progress.rate + 0.3 * rate : rate;
+        progress.last_ms = now;
+        progress.last_done = done;
+    }
+    double rate = progress.rate;
+    if (final && now > progress.start_ms)
+        rate = (double)done * 1000.0 / (double)(now - progress.start_ms);
+    char a[32], b[32], r[32], line[160];
+    int n = snprintf(line, sizeof(line), "\rcc: %s", human_size(a, sizeof(a), (double)done));
+    if (progress.total > 0) {
+        n += snprintf(line + n, sizeof(line) - (size_t)n, " / %s (%d%%)", human_size(b, sizeof(b), (double)progress.total),
+                      (int)(done >= progress.total ? 100 : done * 100 / progress.total));
+    }
+    n += snprintf(line + n, sizeof(line) - (size_t)n, "  %s/s", human_size(r, sizeof(r), rate));
+    if (progress.total > 0 && !final && rate >= 1 && done < progress.total) {
+        long long eta = (long long)((double)(progress.total - done) / rate);
+        n += snprintf(line + n, sizeof(line) - (size_t)n, "  ETA %lld:%02lld:%02lld", eta / 3600, eta / 60 % 60, eta % 60);
+    }
+    fprintf(stderr, "%s   %s", line, final ? "\n" : "");
+    fflush(stderr);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI progress_run(LPVOID arg) {
+#else
+static void *progress_run(void *arg) {
+#endif
+    (void)arg;
+    for (int tick = 1; !__atomic_load_n(&progress.stop, __ATOMIC_ACQUIRE); tick++) {
+        /* Short naps, so a short run is not held up at exit */
+        sleep_ms(25);
+        if (tick % 10 == 0 && !__atomic_load_n(&progress.stop, __ATOMIC_ACQUIRE))
+            progress_print(0);
+    }
+    return 0;
+}
+
+static void progress_start(long long total) {
+    progress.on = 1;
+    progress.total = total;
+    progress.start_ms = progress.last_ms = now_ms();
+#ifdef _WIN32
+    progress.thread = CreateThread(NULL, 0, progress_run, NULL, 0, NULL);
+    progress.started = progress.thread != NULL;
+#else
+    progress.started = (pthread_create(&progress.thread, NULL, progress_run, NULL) == 0);
+#endif
+    if (!progress.started)
+        log_error("Could not start the --progress thread", 0);
+}
+
+static void progress_finish(void) {
+    progress.end_ms = now_ms();
+    __atomic_store_n(&progress.stop, 1, __ATOMIC_RELEASE);
+    if (progress.started) {
+#ifdef _WIN32
+        WaitForSingleObject(progress.thread, INFINITE);
+        CloseHandle(progress.thread);
+#else
+        pthread_join(progress.thread, NULL);
+#endif
+    }
+    progress_print(1);
+}
+
+/* Bytes --progress expects: the inputs' sizes, clipped by --bytes; 0 if any is unknown */
+static long long progress_total(char **files, int count, const Options *opts) {
+    long long total = 0;
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        int r = strcmp(files[i], "-") ? stat(files[i], &st) : fstat(0, &st);
+        if (r < 0 || !S_ISREG(st.st_mode))
+            return 0;
+        long long end = (long long)st.st_size;
+        if (opts->range_end >= 0 && opts->range_end < end)
+            end = opts->range_end;
+        if (opts->range_start < end)
+            total += end - opts->range_start;
+    }
+    return total;
+}
+
+/* Digest of the current input file, fed by every engine as it reads */
+static int in_tap = 0;
+static Digest in_digest;
+
+/* Every engine passes the input it consumes through here, for --digest and --progress */
+static void digest_input(const char *p, size_t n) {
+    if (in_tap)
+        digest_update(&in_digest, p, n);
+    progress_add(n);
+}
+
+/*
+ * Write a digest line in sha256sum format ("HEX  NAME") to out.
+ */
+static void digest_report(FILE *out, const Digest *d, const char *name) {
+    char hex[65];
+    digest_hex(d, hex);
+    if (fprintf(out, "%s  %s\n", hex, name) < 0)
+        log_error("Failed to write digest", 0);
+}
+
+/* -v expansion of every byte value (GNU cat compatible), built by init_vis_table */
+static char vis_table[256][4];
+static unsigned char vis_len[256];
+
+/*
+ * Fill the -v expansion table: ^X for control characters, ^? for DEL, and an
+ * M- prefix for bytes with the high bit set. TAB and NL are filled in too
+ * (as ^I and ^J, M-^I and M-^J in the high half) but are handled by the caller.
+ */
+static void init_vis_table(void) {
+    for (int c = 0; c < 256; c++) {
+        int low = c & 0x7F, n = 0;
+        if (c & 0x80) { vis_table[c][n++] = 'M'; vis_table[c][n++] = '-'; }
+        if (low < 32) { vis_table[c][n++] = '^'; vis_table[c][n++] = (char)(low + 64); }
+        else if (low == 127) { vis_table[c][n++] = '^'; vis_table[c][n++] = '?'; }
+        else vis_table[c][n++] = (char)low;
+        vis_len[c] = (unsigned char)n;
+    }
+}
+
+/*
+ * Length of the leading run of p[0..n) that -v and -T pass through unchanged:
+ * printable ASCII (0x20-0x7E), NL, and TAB unless -T is set. Without -v only
+ * TAB needs attention.
+ */
+static size_t span_clean(const char *p, size_t n, const Options *opts) {
+    if (!opts->flag_nonprinting) {
+        const char *tab = opts->flag_tabs ? memchr(p, '\t', n) : NULL;
+        return tab ? (size_t)(tab - p) : n;
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7F);
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i tab = opts->flag_tabs ? _mm_set1_epi8('\n') : _mm_set1_epi8('\t');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        /* Signed compare: bytes >= 0x80 are negative and fall below 0x20 */
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del));
+        __m128i ok = _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, tab));
+        int m = _mm_movemask_epi8(_mm_andnot_si128(ok, bad));
+        if (m)
+            return i + (size_t)__builtin_ctz((unsigned)m);
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned char c = (unsigned char)p[i];
+        if ((c < 0x20 || c >= 0x7F) && c != '\n' && (c != '\t' || opts->flag_tabs))
+            break;
+    }
+    return i;
+}
+
+/*
+ * Write p[0..n) with -v/-T applied and newlines passed through. Clean runs
+ * are written in bulk; runs of bytes needing expansion go through the -v
+ * table and are staged so binary data does not cost a stdio call per byte.
+ */
+static void emit_transformed(const char *p, size_t n, const Options *opts) {
+    size_t i = 0;
+    while (i < n) {
+        size_t run = span_clean(p + i, n - i, opts);
+        if (run) {
+            out_write(p + i, run);
+            i += run;
+            continue;
+        }
+        if (p[i] == '\t') {  /* Only stops here with -T */
+            out_write(opts->tab_repr, strlen(opts->tab_repr));
+            i++;
+            continue;
+        }
+        char esc[BUFSIZE];
+        size_t m = 0;
+        while (i < n && m + 4 <= sizeof(esc)) {
+            unsigned char c = (unsigned char)p[i];
+            if (c == '\t' || c == '\n' || (c >= 0x20 && c < 0x7F))
+                break;
+            memcpy(esc + m, vis_table[c], 4);
+            m += vis_len[c];
+            i++;
+        }
+        out_write(esc, m);
+    }
+}
+
+/*
+ * Length of the leading run of p[0..n) that needs no escaping inside a JSON
+ * string: ASCII from 0x20 up, except '"' and '\\'.
+ */
+static size_t span_json_clean(const char *p, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(0x20), quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        /* Signed compare also flags bytes >= 0x80 for UTF-8 validation */
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)));
+        int m = _mm_movemask_epi8(bad);
+        if (m)
+            return i + (size_t)__builtin_ctz((unsigned)m);
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned char c = (unsigned char)p[i];
+        if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\')
+            break;
+    }
+    return i;
+}
+
+/*
+ * Length of the well-formed UTF-8 sequence starting at p[0..n), or 0 if the
+ * lead byte does not start one (overlongs and surrogates are rejected).
+ */
+static size_t utf8_seq_len(const unsigned char *p, size_t n) {
+    unsigned char c = p[0];
+    size_t len;
+    unsigned char lo = 0x80, hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) len = 2;
+    else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        if (c == 0xE0) lo = 0xA0;
+        if (c == 0xED) hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        if (c == 0xF0) lo = 0x90;
+        if (c == 0xF4) hi = 0x8F;
+    } else
+        return 0;
+    if (n < len || p[1] < lo || p[1] > hi)
+        return 0;
+    for (size_t k = 2; k < len; k++)
+        if (p[k] < 0x80 || p[k] > 0xBF)
+            return 0;
+    return len;
+}
+
+/*
+ * --auto: whether a sample from the start of an input looks binary. It does
+ * if NULs make up more than 1/256 of it, or bytes that are not valid UTF-8
+ * more than 1/32. ASCII is skipped 16 bytes at a time, counting NULs as it
+ * goes; a sequence cut off by the end of the sample is not held against it.
+ */
+static int looks_binary(const unsigned char *p, size_t n) {
+    size_t nul = 0, bad = 0, i = 0;
+    if (n >= 2 && ((p[0] == 0xFF && p[1] == 0xFE) || (p[0] == 0xFE && p[1] == 0xFF)))
+        return 0;  /* UTF-16 with a BOM is transcoded */
+    while (i < n) {
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            if (_mm_movemask_epi8(v))
+                break;
+            nul += (size_t)__builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+        }
+        if (i >= n)
+            break;
+#endif
+        if (p[i] < 0x80) {
+            nul += !p[i];
+            i++;
+            continue;
+        }
+        size_t len = utf8_seq_len(p + i, n - i);
+        if (len) {
+            i += len;
+        } else {
+            if (n - i < 4)
+                break;
+            bad++;
+            i++;
+        }
+    }
+    return nul * 256 > n || bad * 32 > n;
+}
+
+/* --with-filename: name of the current input, and the "name:" prefix of its lines */
+static const char *line_name = NULL;
+static char *line_prefix = NULL;
+static size_t line_name_len = 0, line_prefix_len = 0;
+
+/*
+ * Write p[0..n) as a quoted JSON string. Clean ASCII runs and well-formed
+ * UTF-8 are copied as they are; quotes, backslashes and control bytes are
+ * escaped, and bytes that are not valid UTF-8 become \ufffd.
+ */
+static void emit_json_string(const char *p, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    char esc[BUFSIZE];
+    size_t i = 0, m = 0;
+    esc[m++] = '"';
+    while (i < n) {
+        size_t run = span_json_clean(p + i, n - i);
+        if (run) {
+            if (m + run > sizeof(esc)) {
+                out_write(esc, m);
+                m = 0;
+                if (run > sizeof(esc)) {
+                    out_write(p + i, run);
+                    i += run;
+                    continue;
+                }
+            }
+            memcpy(esc + m, p + i, run);
+            m += run;
+            i += run;
+            if (i == n)
+                break;
+        }
+        if (m + 6 > sizeof(esc)) {
+            out_write(esc, m);
+            m = 0;
+        }
+        unsigned char c = (unsigned char)p[i];
+        if (c >= 0x80) {
+            size_t len = utf8_seq_len((const unsigned char *)p + i, n - i);
+            if (len) {
+                memcpy(esc + m, p + i, len);
+                m += len;
+                i += len;
+            } else {
+                memcpy(esc + m, "\\ufffd", 6);
+                m += 6;
+                i++;
+            }
+            continue;
+        }
+        esc[m++] = '\\';
+        switch (c) {
+            case '"': esc[m++] = '"'; break;
+            case '\\': esc[m++] = '\\'; break;
+            case '\b': esc[m++] = 'b'; break;
+            case '\f': esc[m++] = 'f'; break;
+            case '\n': esc[m++] = 'n'; break;
+            case '\r': esc[m++] = 'r'; break;
+            case '\t': esc[m++] = 't'; break;
+            default:
+                memcpy(esc + m, "u00", 3);
+                esc[m + 3] = hex[c >> 4];
+                esc[m + 4] = hex[c & 15];
+                m += 5;
+        }
+        i++;
+    }
+    if (m + 1 > sizeof(esc)) {
+        out_write(esc, m);
+        m = 0;
+    }
+    esc[m++] = '"';
+    out_write(esc, m);
+}
+
+/*
+ * --json-lines: write one line (without its newline) as a JSON record.
+ */
+static void emit_json_line(const char *line, size_t len, Options *opts, int *line_no) {
+    int has_nl = (len > 0 && line[len - 1] == '\n');
+    if (opts->json_lines == JSON_OBJECT && line_name) {
+        out_write("{\"file\":", 8);
+        emit_json_string(line_name, line_name_len);
+        out_printf(",\"n\":%d,\"line\":", (*line_no)++);
+    } else if (opts->json_lines == JSON_OBJECT) {
+        out_printf("{\"n\":%d,\"line\":", (*line_no)++);
+    }
+    emit_json_string(line, len - has_nl);
+    if (opts->json_lines == JSON_OBJECT)
+        out_putc('}');
+    if (opts->eol_mode == EOL_DOS)
+        out_putc('\r');
+    out_putc('\n');
+}
+
+/*
+ * --framed: write one line (without its newline) as a binary record: its
+ * length, then with --frame-seq the line number as a u64, both little-endian,
+ * then the line. The header is built in the slot of the span it goes out as,
+ * so it stays put until the writev, and the line is not copied.
+ */
+static unsigned char frame_hdr[SPAN_IOVS][FRAME_HDR_MAX];
+
+static void emit_framed_line(const char *line, size_t len, Options *opts, int *line_no) {
+    size_t n = len - (len > 0 && line[len - 1] == '\n');
+    if (out_iovcnt + 2 > SPAN_IOVS)
+        out_spans_flush();
+    unsigned char *h = frame_hdr[out_iovcnt];
+    size_t hl = 0;
+    if (opts->framed == FRAME_U32) {
+        if (n > 0xFFFFFFFFu) {
+            fprintf(stderr, "cc: --framed=u32: a line is 4GB or longer; use --framed=varint\n");
+            exit(EXIT_FAILURE);
+        }
+        for (; hl < 4; hl++)
+            h[hl] = (unsigned char)(n >> (8 * hl));
+    } else {
+        uint64_t v = n;
+        do {
+            h[hl++] = (unsigned char)((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+            v >>= 7;
+        } while (v);
+    }
+    if (opts->frame_seq) {
+        uint64_t seq = (uint64_t)(*line_no)++;
+        for (int k = 0; k < 8; k++)
+            h[hl++] = (unsigned char)(seq >> (8 * k));
+    }
+    out_span(h, hl);
+    if (n)
+        out_span(line, n);
+}
+
+/*
+ * Process a single line with optional formatting.
+ * Uses a fast path when no transformations are requested.
+ */
+static inline void process_line_buffer(const char *line, size_t len, Options *opts, int *line_no) {
+    if (opts->framed) {
+        emit_framed_line(line, len, opts, line_no);
+        return;
+    }
+    if (opts->json_lines) {
+        emit_json_line(line, len, opts, line_no);
+        return;
+    }
+    int is_blank = (len == 1 && line[0] == '\n');
+    int numbered = opts->flag_num || (opts->flag_nnb && !is_blank);
+    int plain = !opts->flag_tabs && !opts->flag_nonprinting && !opts->flag_ends && opts->eol_mode != EOL_DOS;
+    if (line_prefix) {
+        if (plain && !numbered) {
+            /* Written by scan_lines with one writev per block */
+            out_span(line_prefix, line_prefix_len);
+            out_span(line, len);
+            if (line[len - 1] != '\n')
+                out_span("\n", 1);  /* Keep the next file's prefix at a line start */
+            return;
+        }
+        out_write(line_prefix, line_prefix_len);
+    }
+    if (numbered)
+        out_printf(opts->line_format, (*line_no)++);
+
+    if (plain) {
+        if (out_write(line, len) != len)
+            log_error("fwrite failed in fast path", 0);
+        if (line_prefix && line[len - 1] != '\n')
+            out_putc('\n');
+        return;
+    }
+    int has_nl = (len > 0 && line[len - 1] == '\n');
+    emit_transformed(line, len - has_nl, opts);
+    if (has_nl) {
+        if (opts->flag_ends)
+            out_write(opts->end_marker, strlen(opts->end_marker));
+        if (opts->eol_mode == EOL_DOS)
+            out_putc('\r');
+        out_putc('\n');
+    } else if (line_prefix) {
+        out_putc('\n');
+    }
+}
+
+/*
+ * True when an option other than -s needs to see every line.
+ */
+static int needs_lines(const Options *opts) {
+    return opts->flag_num || opts->flag_nnb || opts->flag_ends || opts->eol_mode == EOL_DOS ||
+           opts->json_lines || opts->match || opts->exclude || opts->sample_every || opts->sample_rate >= 0 ||
+           opts->with_filename || opts->uniq || opts->dedupe || opts->framed;
+}
+
+/*
+ * True when -s is the only transformation, so blank-line squeezing can run
+ * over whole blocks instead of individual lines.
+ */
+static int squeeze_only(const Options *opts) {
+    return opts->flag_squeeze && !needs_lines(opts) && !opts->flag_tabs && !opts->flag_nonprinting;
+}
+
+/*
+ * True when no option works on whole lines (-v and -T act on single bytes),
+ * so input can be handled in blocks without splitting it into lines.
+ */
+static int bytewise_only(const Options *opts) {
+    return !needs_lines(opts) && !opts->flag_squeeze;
+}
+
+/*
+ * Offset of the first byte a in p[0..n) that is immediately followed by
+ * byte b, or n if there is none.
+ */
+static size_t find_byte_pair(const char *p, size_t n, char a, char b) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    for (; i + 17 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(p + i + 1));
+        int m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(y, vb)));
+        if (m)
+            return i + (size_t)__builtin_ctz((unsigned)m);
+    }
+#endif
+    while (i + 1 < n) {
+        const char *q = memchr(p + i, a, n - i - 1);
+        if (!q)
+            break;
+        i = (size_t)(q - p);
+        if (p[i + 1] == b)
+            return i;
+        i++;
+    }
+    return n;
+}
+
+/*
+ * Offset of the first occurrence of s[0..k) (k > 0) in p[0..n), or n if
+ * there is none. Candidates are found 16 positions at a time by comparing
+ * the first and the last byte of s with SSE2; only those are compared in full.
+ */
+static size_t find_str(const char *p, size_t n, const char *s, size_t k) {
+    size_t i = 0;
+    if (k > n)
+        return n;
+    if (k == 1) {
+        const char *q = memchr(p, s[0], n);
+        return q ? (size_t)(q - p) : n;
+    }
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(s[0]), last = _mm_set1_epi8(s[k - 1]);
+    for (; i + k - 1 + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(p + i + k - 1));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, first), _mm_cmpeq_epi8(y, last)));
+        while (m) {
+            size_t c = i + (size_t)__builtin_ctz(m);
+            if (!memcmp(p + c + 1, s + 1, k - 2))
+                return c;
+            m &= m - 1;
+        }
+    }
+#endif
+    while (i + k <= n) {
+        const char *q = memchr(p + i, s[0], n - k + 1 - i);
+        if (!q)
+            break;
+        i = (size_t)(q - p);
+        if (p[i + k - 1] == s[k - 1] && !memcmp(p + i + 1, s + 1, k - 2))
+            return i;
+        i++;
+    }
+    return n;
+}
+
+/*
+ * Copy p[0..n) to out, dropping every CR that directly precedes an LF; out
+ * must have room for n + 1 bytes. A CR in the last byte is held back in
+ * *pending_cr until the next block shows whether an LF follows it.
+ * Returns the number of bytes written.
+ */
+static size_t strip_crlf(const char *p, size_t n, char *out, int *pending_cr) {
+    size_t i = 0, o = 0;
+    if (*pending_cr) {
+        *pending_cr = 0;
+        if (p[0] != '\n')
+            out[o++] = '\r';
+    }
+    if (p[n - 1] == '\r') {
+        *pending_cr = 1;
+        n--;
+    }
+    while (i < n) {
+        size_t k = find_byte_pair(p + i, n - i, '\r', '\n');
+        memcpy(out + o, p + i, k);
+        o += k;
+        i += k + 1;
+    }
+    return o;
+}
+
+/*
+ * Squeeze blank lines in data[0..size) and write the rest unchanged.
+ * Works on runs of newlines, so blocks need not be line-aligned: text between
+ * blank lines is written in bulk. *blank_count is the number of blank lines in
+ * the current run at a line start (as in format_lines), or -1 mid-line.
+ */
+static void squeeze_block(const char *data, size_t size, Options *opts, int *blank_count) {
+    size_t i = 0, span = 0;
+    while (i < size) {
+        if (*blank_count >= 0) {
+            if (data[i] == '\n') {
+                if (++*blank_count > opts->squeeze_limit) {
+                    out_write(data + span, i - span);
+                    span = i + 1;
+                }
+                i++;
+                continue;
+            }
+            *blank_count = -1;
+        }
+        size_t k = find_byte_pair(data + i, size - i, '\n', '\n');
+        if (k == size - i) {
+            *blank_count = (data[size - 1] == '\n') ? 0 : -1;
+            break;
+        }
+        i += k + 1;
+        *blank_count = 0;
+    }
+    out_write(data + span, size - span);
+}
+
+/* --sample-rate generator (xorshift64*), seeded by --seed or the clock */
+static uint64_t sample_state;
+
+static uint64_t sample_next(void) {
+    sample_state ^= sample_state >> 12;
+    sample_state ^= sample_state << 25;
+    sample_state ^= sample_state >> 27;
+    return sample_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* Natural logarithm for 0 < x <= 1, which keeps libm out of the build */
+static double sample_log(double x) {
+    int e = 0;
+    while (x < 0.5) { x *= 2; e--; }
+    /* ln x = 2 atanh(z) with z = (x - 1) / (x + 1), |z| <= 1/3 */
+    double z = (x - 1) / (x + 1), z2 = z * z, term = z, sum = 0;
+    for (int k = 1; k < 40; k += 2) {
+        sum += term / k;
+        term *= z2;
+    }
+    return 2 * sum + e * 0.69314718055994531;
+}
+
+/*
+ * Lines to leave out before the next sampled one. For --sample-rate the gap
+ * is drawn from the geometric distribution, which keeps each line with
+ * probability P without a random draw per line.
+ */
+static long long sample_gap(const Options *opts) {
+    if (opts->sample_every)
+        return opts->sample_every - 1;
+    if (opts->sample_rate >= 1)
+        return 0;
+    if (opts->sample_rate <= 0)
+        return 0x7FFFFFFFFFFFFFFFLL;
+    double u = (double)((sample_next() >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double gap = sample_log(u) / sample_log(1 - opts->sample_rate);
+    return (gap >= 9e18) ? 0x7FFFFFFFFFFFFFFFLL : (long long)gap;
+}
+
+/* State of the text engine for one input, carried across blocks and windows */
+typedef struct {
+    Options *opts;
+    int *line_no;
+    int blank_count;      /* -s: blank lines in the current run (-1 mid-line in squeeze_block) */
+    int pending_cr;       /* --unix-eol/--dos-eol: the last block ended with CR */
+    int utf16;            /* UTF16_LE, UTF16_BE or UTF16_NONE once known, UTF16_AUTO before */
+    int bom_checked;      /* The first two bytes have been examined */
+    int u16_skip;         /* BOM bytes still to drop */
+    int u16_odd;          /* Odd byte left over from the last block, or -1 */
+    unsigned u16_high;    /* High surrogate waiting for its pair, or 0 */
+    int u16_head;         /* First byte while a one-byte block delays the BOM check, or -1 */
+    char *u16_buf;        /* UTF-8 output of the transcoder */
+    char *carry;          /* Partial line waiting for the rest of its bytes */
+    size_t carry_len, carry_cap;
+    long long sample_skip; /* --sample: lines to leave out before the next one kept */
+    long long ml_used;    /* --max-line: bytes or characters of the current line let through */
+    long long ml_dropped; /* ...and bytes of it dropped so far by truncation */
+    int ml_dropping;      /* The current line is over the limit and being dropped */
+    char ml_hold[4];      /* Start of a character cut off by the end of the last block */
+    int ml_hold_len;
+} TextState;
+
+static void text_init(TextState *ts, Options *opts, int *line_no) {
+    memset(ts, 0, sizeof(*ts));
+    ts->opts = opts;
+    ts->line_no = line_no;
+    ts->utf16 = (opts->from_utf16 == UTF16_LE || opts->from_utf16 == UTF16_BE) ? opts->from_utf16 : UTF16_AUTO;
+    ts->u16_odd = -1;
+    ts->u16_head = -1;
+    if (opts->sample_every || opts->sample_rate >= 0)
+        ts->sample_skip = sample_gap(opts);
+}
+
+/*
+ * --uniq and --dedupe, which run on the lines that are about to be written.
+ * --uniq compares each line (without its newline) with the previous one: by
+ * length first, then by content, which is either still in the caller's block
+ * or copied out when the block ends. --uniq=count holds each line back until
+ * its run ends. --dedupe keeps the XXH3 hash of every line seen in an
+ * open-addressing set; past --dedupe-memory the set becomes a Bloom filter of
+ * that size, which may also drop some lines that were never seen.
+ */
+static struct {
+    Options *opts;
+    int *line_no;
+    int have;                   /* A previous line exists */
+    const char *prev;           /* The previous line, in the caller's block or in buf */
+    size_t prev_len;            /* Its length without the newline */
+    char *buf;                  /* Copy of the previous line (with its newline) */
+    size_t buf_len, buf_cap;
+    long long repeats;          /* --uniq=count: occurrences of the line in buf */
+    char *prefix;               /* --uniq=count: --with-filename prefix of the line in buf */
+    size_t prefix_len, prefix_cap;
+    uint64_t *slot;             /* --dedupe: hashes, 0 for an empty slot */
+    size_t mask, used;
+    unsigned char *bloom;       /* --dedupe past the memory cap */
+    uint64_t bloom_mask;
+} lines_seen;
+
+static void dup_keep(const char *line, size_t len) {
+    if (len > lines_seen.buf_cap) {
+        size_t cap = lines_seen.buf_cap ? lines_seen.buf_cap : BUFSIZE;
+        while (cap < len) cap *= 2;
+        char *grown = realloc(lines_seen.buf, cap);
+        if (!grown) log_error("realloc failed for --uniq", 1);
+        lines_seen.buf = grown;
+        lines_seen.buf_cap = cap;
+    }
+    memcpy(lines_seen.buf, line, len);
+    lines_seen.buf_len = len;
+    lines_seen.prev = lines_seen.buf;
+}
+
+/* Bloom filter test-and-set: returns 1 if all seven bits were already set */
+static int bloom_seen(uint64_t h) {
+    uint64_t h2 = (h >> 32) | 1;
+    int seen = 1;
+    for (int i = 0; i < 7; i++) {
+        uint64_t bit = (h + (uint64_t)i * h2) & lines_seen.bloom_mask;
+        unsigned char m = (unsigned char)(1u << (bit & 7));
+        if (!(lines_seen.bloom[bit >> 3] & m)) {
+            seen = 0;
+            lines_seen.bloom[bit >> 3] |= m;
+        }
+    }
+    return seen;
+}
+
+/* Switch to a Bloom filter of --dedupe-memory bytes; the caller moves the hashes over */
+static void dedupe_to_bloom(void) {
+    uint64_t bytes = 1;
+    while (bytes * 2 <= (uint64_t)lines_seen.opts->dedupe_memory) bytes *= 2;
+    fprintf(stderr, "cc: --dedupe: %zu distinct lines reached the memory cap; "
+                    "continuing approximately (some new lines may be dropped)\n", lines_seen.used);
+    if (!(lines_seen.bloom = calloc((size_t)bytes, 1)))
+        log_error("malloc failed for --dedupe", 1);
+    lines_seen.bloom_mask = bytes * 8 - 1;
+}
+
+/* Add h to the set; returns 1 if it was there already */
+static int dedupe_seen(uint64_t h) {
+    if (lines_seen.bloom)
+        return bloom_seen(h);
+    if (!h)
+        h = 1;
+    if (!lines_seen.slot || (lines_seen.used + 1) * 2 > lines_seen.mask + 1) {
+        size_t size = lines_seen.slot ? 2 * (lines_seen.mask + 1) : 1024;
+        uint64_t *old = lines_seen.slot;
+        size_t old_size = lines_seen.slot ? lines_seen.mask + 1 : 0;
+        if ((long long)(size * sizeof(uint64_t)) > lines_seen.opts->dedupe_memory) {
+            dedupe_to_bloom();
+            for (size_t i = 0; i < old_size; i++)
+                if (old[i])
+                    bloom_seen(old[i]);
+            free(old);
+            lines_seen.slot = NULL;
+            return bloom_seen(h);
+        }
+        if (!(lines_seen.slot = calloc(size, sizeof(uint64_t))))
+            log_error("malloc failed for --dedupe", 1);
+        lines_seen.mask = size - 1;
+        for (size_t i = 0; i < old_size; i++) {
+            if (!old[i])
+                continue;
+            size_t j = (size_t)old[i] & lines_seen.mask;
+            while (lines_seen.slot[j]) j = (j + 1) & lines_seen.mask;
+            lines_seen.slot[j] = old[i];
+        }
+        free(old);
+    }
+    size_t i = (size_t)h & lines_seen.mask;
+    while (lines_seen.slot[i]) {
+        if (lines_seen.slot[i] == h)
+            return 1;
+        i = (i + 1) & lines_seen.mask;
+    }
+    lines_seen.slot[i] = h;
+    lines_seen.used++;
+    return 0;
+}
+
+static uint64_t line_hash(const char *p, size_t n) {
+    if (n <= 240)
+        return xxh3_short((const unsigned char *)p, n);
+    Digest d;
+    digest_init(&d, DIGEST_XXH3);
+    digest_update(&d, p, n);
+    return xxh3_digest(&d);
+}
+
+/* --uniq=count: remember the prefix of the input the held-back line came from */
+static void uniq_keep_prefix(void) {
+    size_t n = line_prefix ? line_prefix_len : 0;
+    if (n > lines_seen.prefix_cap) {
+        char *grown = realloc(lines_seen.prefix, n);
+        if (!grown)
+            log_error("realloc failed for --uniq=count", 1);
+        lines_seen.prefix = grown;
+        lines_seen.prefix_cap = n;
+    }
+    if (n)
+        memcpy(lines_seen.prefix, line_prefix, n);
+    lines_seen.prefix_len = n;
+}
+
+/*
+ * --uniq=count: write the held-back line with the length of its run, after
+ * the prefix of the input the run began in. The line goes out through stdio,
+ * not as a span, since buf is reused for the next line before spans are
+ * written.
+ */
+static void uniq_flush(void) {
+    if (!lines_seen.have || !lines_seen.opts->uniq_count)
+        return;
+    if (out_iovcnt)
+        out_spans_flush();
+    char *prefix = line_prefix;
+    size_t prefix_len = line_prefix_len;
+    line_prefix = NULL;
+    if (lines_seen.prefix_len)
+        out_write(lines_seen.prefix, lines_seen.prefix_len);
+    out_printf("%7lld ", lines_seen.repeats);
+    process_line_buffer(lines_seen.buf, lines_seen.buf_len, lines_seen.opts, lines_seen.line_no);
+    if (lines_seen.prefix_len && lines_seen.buf[lines_seen.buf_len - 1] != '\n')
+        out_putc('\n');  /* Keep the next prefix at a line start */
+    line_prefix = prefix;
+    line_prefix_len = prefix_len;
+    lines_seen.have = 0;
+}
+
+/*
+ * Decide whether line[0..len) is written now: 1 drops it as a duplicate (or,
+ * for --uniq=count, holds it back), 0 lets it through.
+ */
+static int drop_duplicate(Options *opts, int *line_no, const char *line, size_t len) {
+    size_t n = len - (line[len - 1] == '\n');
+    lines_seen.opts = opts;
+    lines_seen.line_no = line_no;
+    if (opts->dedupe)
+        return dedupe_seen(line_hash(line, n));
+    if (lines_seen.have && n == lines_seen.prev_len && !memcmp(line, lines_seen.prev, n)) {
+        lines_seen.repeats++;
+        return 1;
+    }
+    if (opts->uniq_count) {
+        uniq_flush();
+        dup_keep(line, len);
+        uniq_keep_prefix();
+    } else {
+        lines_seen.prev = line;
+    }
+    lines_seen.have = 1;
+    lines_seen.prev_len = n;
+    lines_seen.repeats = 1;
+    return opts->uniq_count;
+}
+
+/*
+ * Split data[0..size) into lines and format them; the last line may lack
+ * its newline. Lines dropped by --filter-after (keep unset) still advance
+ * the blank line run and the line number, but are not written.
+ */
+static void scan_lines(TextState *ts, const char *data, size_t size, int keep) {
+    Options *opts = ts->opts;
+    size_t i = 0;
+    while (i < size) {
+        size_t ls = i;
+        const char *nl = memchr(data + i, '\n', size - i);
+        i = nl ? (size_t)(nl - data) + 1 : size;
+        size_t ll = i - ls;
+        int is_blank = (ll == 1 && data[ls] == '\n');
+        if (opts->flag_squeeze && is_blank) {
+            if (++ts->blank_count > opts->squeeze_limit)
+                continue;
+        } else {
+            ts->blank_count = 0;
+        }
+        if (keep) {
+            if ((opts->uniq || opts->dedupe) && drop_duplicate(opts, ts->line_no, data + ls, ll))
+                continue;
+            process_line_buffer(data + ls, ll, opts, ts->line_no);
+        } else if (opts->json_lines ? opts->json_lines == JSON_OBJECT : (opts->flag_num || (opts->flag_nnb && !is_blank)))
+            (*ts->line_no)++;
+    }
+    if (out_iovcnt)
+        out_spans_flush();
+    /* The previous line for --uniq must outlive the block */
+    if (lines_seen.have && lines_seen.prev != lines_seen.buf)
+        dup_keep(lines_seen.prev, lines_seen.prev_len);
+}
+
+/*
+ * Lines of data[0..size) that --match/--exclude leave out. Before numbering
+ * they vanish; with --filter-after they are only counted.
+ */
+static void drop_lines(TextState *ts, const char *data, size_t size) {
+    Options *opts = ts->opts;
+    if (opts->filter_after && (opts->flag_squeeze || opts->flag_num || opts->flag_nnb || opts->json_lines))
+        scan_lines(ts, data, size, 0);
+}
+
+/*
+ * --match/--exclude over data[0..size). The whole block is searched for the
+ * --match string (or, without one, the --exclude string); each hit is widened
+ * to its line, and the lines between hits are kept or dropped as a group.
+ */
+static void filter_lines(TextState *ts, const char *data, size_t size) {
+    Options *opts = ts->opts;
+    const char *key = opts->match ? opts->match : opts->exclude;
+    size_t key_len = opts->match ? opts->match_len : opts->exclude_len;
+    size_t i = 0;
+    while (i < size) {
+        size_t h = i + find_str(data + i, size - i, key, key_len);
+        size_t ls = h, le = size;
+        if (h < size) {
+            while (ls > i && data[ls - 1] != '\n') ls--;
+            const char *nl = memchr(data + h, '\n', size - h);
+            if (nl) le = (size_t)(nl - data) + 1;
+        }
+        /* Lines before the hit do not contain the key */
+        if (opts->match)
+            drop_lines(ts, data + i, ls - i);
+        else
+            scan_lines(ts, data + i, ls - i, 1);
+        if (h < size) {
+            if (opts->match && (!opts->exclude ||
+                find_str(data + ls, le - ls, opts->exclude, opts->exclude_len) == le - ls))
+                scan_lines(ts, data + ls, le - ls, 1);
+            else
+                drop_lines(ts, data + ls, le - ls);
+        }
+        i = le;
+    }
+}
+
+/* Format data[0..size) as selected by --match/--exclude */
+static void select_lines(TextState *ts, const char *data, size_t size) {
+    if (ts->opts->match || ts->opts->exclude)
+        filter_lines(ts, data, size);
+    else
+        scan_lines(ts, data, size, 1);
+}
+
+/*
+ * Offset just past the *want-th newline in p[0..n) (*want > 0), which must
+ * start at a line start; n if there are fewer. *want is reduced by the
+ * newlines passed and, if blank is set, the empty lines among them are
+ * added to *blank. Newlines are counted 16 bytes at a time with popcount.
+ */
+static size_t skip_lines(const char *p, size_t n, long long *want, long long *blank) {
+    size_t i = 0;
+    unsigned prev = 1;  /* The byte before p[i] ended a line */
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl));
+        long long c = __builtin_popcount(m);
+        unsigned last = 0, cut = 0xFFFF;
+        if (c >= *want) {
+            last = m;
+            for (long long k = *want; --k > 0; )
+                last &= last - 1;
+            cut = ((last & -last) << 1) - 1;
+        }
+        if (blank)
+            *blank += __builtin_popcount(m & ((m << 1) | prev) & cut);
+        if (last) {
+            *want = 0;
+            return i + (size_t)__builtin_ctz(last) + 1;
+        }
+        *want -= c;
+        prev = m >> 15;
+    }
+#endif
+    while (i < n) {
+        const char *q = memchr(p + i, '\n', n - i);
+        if (!q)
+            return n;
+        size_t j = (size_t)(q - p);
+        if (blank)
+            *blank += j ? (p[j - 1] == '\n') : prev;
+        i = j + 1;
+        if (!--*want)
+            return i;
+    }
+    return n;
+}
+
+/*
+ * --sample over data[0..size): lines left out are jumped over in bulk and
+ * only advance the line number, so numbers stay those of the input.
+ */
+static void sample_lines(TextState *ts, const char *data, size_t size) {
+    Options *opts = ts->opts;
+    size_t i = 0;
+    while (i < size) {
+        if (ts->sample_skip > 0) {
+            long long before = ts->sample_skip, blank = 0;
+            size_t k = skip_lines(data + i, size - i, &ts->sample_skip, opts->flag_nnb ? &blank : NULL);
+            long long skipped = before - ts->sample_skip;
+            if (opts->json_lines ? opts->json_lines == JSON_OBJECT : opts->flag_num)
+                *ts->line_no += (int)skipped;
+            else if (opts->flag_nnb)
+                *ts->line_no += (int)(skipped - blank);
+            i += k;
+            continue;
+        }
+        const char *nl = memchr(data + i, '\n', size - i);
+        size_t le = nl ? (size_t)(nl - data) + 1 : size;
+        select_lines(ts, data + i, le - i);
+        ts->sample_skip = sample_gap(opts);
+        i = le;
+    }
+}
+
+static void format_lines(TextState *ts, const char *data, size_t size) {
+    if (ts->opts->sample_every || ts->opts->sample_rate >= 0)
+        sample_lines(ts, data, size);
+    else
+        select_lines(ts, data, size);
+}
+
+/*
+ * Append len bytes to the carried partial line.
+ */
+static void carry_append(TextState *ts, const char *p, size_t len) {
+    if (!len)
+        return;  /* carry may still be NULL */
+    if (ts->carry_len + len > ts->carry_cap) {
+        size_t cap = ts->carry_cap ? ts->carry_cap : BUFSIZE;
+        while (cap < ts->carry_len + len) cap *= 2;
+        char *grown = realloc(ts->carry, cap);
+        if (!grown) log_error("realloc failed for line carry buffer", 1);
+        ts->carry = grown;
+        ts->carry_cap = cap;
+    }
+    memcpy(ts->carry + ts->carry_len, p, len);
+    ts->carry_len += len;
+}
+
+/*
+ * Format a block whose line endings are already normalized. Block-wise modes
+ * take it as it comes; otherwise complete lines are formatted in place and a
+ * trailing partial line is carried over to the next block.
+ */
+static void text_lines(TextState *ts, const char *buf, size_t n) {
+    if (squeeze_only(ts->opts)) {
+        squeeze_block(buf, n, ts->opts, &ts->blank_count);
+        return;
+    }
+    if (bytewise_only(ts->opts)) {
+        emit_transformed(buf, n, ts->opts);
+        return;
+    }
+    size_t i = 0, end = n;
+    if (ts->carry_len) {
+        const char *nl = memchr(buf, '\n', n);
+        i = nl ? (size_t)(nl - buf) + 1 : n;
+        carry_append(ts, buf, i);
+        if (!nl)
+            return;
+        format_lines(ts, ts->carry, ts->carry_len);
+        ts->carry_len = 0;
+    }
+    while (end > i && buf[end - 1] != '\n') end--;
+    format_lines(ts, buf + i, end - i);
+    carry_append(ts, buf + end, n - end);
+}
+
+/*
+ * Offset in p[0..n) where character k + 1 starts, or n if fewer start there;
+ * *chars gets the number of characters that start before it. Characters are
+ * counted by their first bytes (all but 10xxxxxx), 16 bytes at a time.
+ */
+static size_t utf8_skip_chars(const char *p, size_t n, long long k, long long *chars) {
+    size_t i = 0;
+    long long left = k;
+#ifdef __SSE2__
+    const __m128i cont = _mm_set1_epi8(-65);  /* 0xBF: the highest continuation byte */
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpgt_epi8(v, cont));
+        int c = __builtin_popcount(m);
+        if (c > left) {
+            while (left--)
+                m &= m - 1;
+            *chars = k;
+            return i + (size_t)__builtin_ctz(m);
+        }
+        left -= c;
+    }
+#endif
+    for (; i < n; i++) {
+        if (((unsigned char)p[i] & 0xC0) != 0x80 && left-- == 0) {
+            *chars = k;
+            return i;
+        }
+    }
+    *chars = k - left;
+    return n;
+}
+
+/*
+ * How much of the line content p[0..n) fits in budget bytes or characters,
+ * without splitting a character; *units gets what it uses of the budget.
+ * With a byte budget, a line start always takes a whole character, so a
+ * limit below 4 may be exceeded; so may invalid UTF-8 that starts with stray
+ * continuation bytes.
+ */
+static size_t limit_span(const char *p, size_t n, long long budget, int chars, int line_start, long long *units) {
+    if (chars)
+        return utf8_skip_chars(p, n, budget, units);
+    if (budget < 0)
+        budget = 0;
+    size_t cut = (budget < (long long)n) ? (size_t)budget : n;
+    while (cut > 0 && cut < n && ((unsigned char)p[cut] & 0xC0) == 0x80)
+        cut--;
+    if (cut == 0 && n && (line_start || ((unsigned char)p[0] & 0xC0) == 0x80)) {
+        cut = 1;
+        while (cut < n && ((unsigned char)p[cut] & 0xC0) == 0x80)
+            cut++;
+    }
+    *units = (long long)cut;
+    return cut;
+}
+
+/* --max-line: the end of a truncated line, with its [+N bytes] marker */
+static void limit_line_end(TextState *ts) {
+    if (ts->opts->max_line_marker && ts->ml_dropped) {
+        char marker[40];
+        int m = snprintf(marker, sizeof(marker), "[+%lld bytes]", ts->ml_dropped);
+        text_lines(ts, marker, (size_t)m);
+    }
+    ts->ml_dropping = 0;
+    ts->ml_dropped = 0;
+}
+
+/* Bytes at the end of p[0..n) that start a character without finishing it */
+static size_t utf8_tail_cut(const char *p, size_t n) {
+    for (size_t k = 1; k <= 3 && k <= n; k++) {
+        unsigned char b = (unsigned char)p[n - k];
+        if ((b & 0xC0) == 0x80)
+            continue;
+        size_t need = (b >= 0xF0) ? 4 : (b >= 0xE0) ? 3 : (b >= 0xC0) ? 2 : 1;
+        return need > k ? k : 0;
+    }
+    return 0;
+}
+
+/*
+ * --max-line over one block (see limit_lines). With hold, a byte-limited line
+ * that the block ends in the middle of a character keeps that character
+ * back, so where the line is cut does not depend on how input is read.
+ */
+static void limit_block(TextState *ts, const char *p, size_t n, int hold) {
+    const Options *opts = ts->opts;
+    size_t i = 0, rs = 0, e = 0;  /* p[rs..i) is passed on as it is */
+    const char *nl = NULL;
+    int found = 0;                /* e is the end of the line at i */
+    while (i < n) {
+        if (!found) {
+            nl = memchr(p + i, '\n', n - i);
+            e = nl ? (size_t)(nl - p) : n;
+            found = 1;
+        }
+        if (!ts->ml_dropping && i < e) {
+            long long units;
+            size_t take = limit_span(p + i, e - i, opts->max_line - ts->ml_used, opts->max_line_chars,
+                                     ts->ml_used == 0, &units);
+            ts->ml_used += units;
+            if (i + take < e) {
+                text_lines(ts, p + rs, i + take - rs);
+                rs = i += take;
+                if (opts->max_line_wrap) {
+                    text_lines(ts, "\n", 1);
+                    ts->ml_used = 0;
+                    continue;
+                }
+                ts->ml_dropping = 1;
+            }
+        }
+        if (ts->ml_dropping) {
+            ts->ml_dropped += (long long)(e - i);
+            rs = e;
+            if (nl)
+                limit_line_end(ts);
+        }
+        if (nl)
+            ts->ml_used = 0;
+        i = nl ? e + 1 : n;
+        found = 0;
+    }
+    if (hold && !opts->max_line_chars && !ts->ml_dropping && !nl && rs < n) {
+        size_t t = utf8_tail_cut(p + rs, n - rs);
+        memcpy(ts->ml_hold, p + n - t, t);
+        ts->ml_hold_len = (int)t;
+        ts->ml_used -= (long long)t;
+        n -= t;
+    }
+    if (rs < n)
+        text_lines(ts, p + rs, n - rs);
+}
+
+/*
+ * --max-line: pass p[0..n) on to text_lines with every line cut down to the
+ * limit: past it, the rest of a line is dropped (truncate) or starts a new
+ * line (wrap). At most a character is held back, so nothing downstream
+ * carries more than the limit of any line, however long it is. Runs that
+ * pass unchanged go on in one piece.
+ */
+static void limit_lines(TextState *ts, const char *p, size_t n) {
+    if (!ts->opts->max_line) {
+        text_lines(ts, p, n);
+        return;
+    }
+    if (ts->ml_hold_len && n) {
+        /* Finish the held character first */
+        char c[8];
+        size_t k = (size_t)ts->ml_hold_len;
+        memcpy(c, ts->ml_hold, k);
+        while (k < 4 && n && ((unsigned char)*p & 0xC0) == 0x80) {
+            c[k++] = *p++;
+            n--;
+        }
+        ts->ml_hold_len = 0;
+        limit_block(ts, c, k, 1);
+    }
+    limit_block(ts, p, n, 1);
+}
+
+/*
+ * Feed a block of UTF-8 (or unknown 8-bit) text to the text engine. With
+ * --unix-eol/--dos-eol the block is first normalized to LF line endings,
+ * EOL_CHUNK bytes at a time.
+ */
+static void text_feed_utf8(TextState *ts, const char *p, size_t n) {
+    if (n == 0)
+        return;
+    if (ts->opts->eol_mode == EOL_KEEP) {
+        limit_lines(ts, p, n);
+        return;
+    }
+    char out[EOL_CHUNK + 1];
+    while (n > 0) {
+        size_t k = (n < EOL_CHUNK) ? n : EOL_CHUNK;
+        limit_lines(ts, out, strip_crlf(p, k, out, &ts->pending_cr));
+        p += k;
+        n -= k;
+    }
+}
+
+/*
+ * Settle the input encoding from its first two bytes. A UTF-16 BOM selects
+ * transcoding in that byte order and is dropped; without one, --from-utf16
+ * assumes little-endian and the default leaves the input alone.
+ */
+static void utf16_decide(TextState *ts, const unsigned char *p) {
+    int le = (p[0] == 0xFF && p[1] == 0xFE), be = (p[0] == 0xFE && p[1] == 0xFF);
+    if (ts->utf16 == UTF16_AUTO) {
+        if (le || be)
+            ts->utf16 = le ? UTF16_LE : UTF16_BE;
+        else
+            ts->utf16 = (ts->opts->from_utf16 == UTF16_BOM) ? UTF16_LE : UTF16_NONE;
+    }
+    ts->u16_skip = ((ts->utf16 == UTF16_LE && le) || (ts->utf16 == UTF16_BE && be)) ? 2 : 0;
+    ts->bom_checked = 1;
+}
+
+/*
+ * Write the UTF-8 encoding of code point cp to out; returns its length.
+ */
+static size_t put_utf8(char *out, unsigned cp) {
+    if (cp < 0x80) { out[0] = (char)cp; return 1; }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+/*
+ * Convert one UTF-16 code unit, pairing surrogates across calls. Unpaired
+ * surrogates become U+FFFD. Returns the number of bytes written (at most 6).
+ */
+static size_t utf16_unit(TextState *ts, unsigned u, char *out) {
+    size_t o = 0;
+    if (ts->u16_high) {
+        unsigned hi = ts->u16_high;
+        ts->u16_high = 0;
+        if (u >= 0xDC00 && u <= 0xDFFF)
+            return put_utf8(out, 0x10000 + ((hi - 0xD800) << 10) + (u - 0xDC00));
+        o = put_utf8(out, 0xFFFD);
+    }
+    if (u >= 0xD800 && u <= 0xDBFF) {
+        ts->u16_high = u;
+        return o;
+    }
+    if (u >= 0xDC00 && u <= 0xDFFF)
+        u = 0xFFFD;
+    return o + put_utf8(out + o, u);
+}
+
+/*
+ * Transcode UTF-16 in p[0..n) to UTF-8 in out, which needs room for
+ * 3 * (n / 2 + 2) bytes. Blocks of eight ASCII code units are narrowed with
+ * SSE2 in one step. An odd trailing byte is kept for the next block.
+ */
+static size_t utf16_to_utf8(TextState *ts, const unsigned char *p, size_t n, char *out) {
+    int be = (ts->utf16 == UTF16_BE);
+    size_t i = 0, o = 0;
+    if (ts->u16_odd >= 0 && n > 0) {
+        unsigned b = (unsigned)ts->u16_odd;
+        o += utf16_unit(ts, be ? (b << 8 | p[0]) : ((unsigned)p[0] << 8 | b), out);
+        ts->u16_odd = -1;
+        i = 1;
+    }
+    while (i + 1 < n) {
+        size_t end = n;
+#ifdef __SSE2__
+        if (i + 16 <= n) {
+            if (!ts->u16_high) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+                if (be)
+                    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+                __m128i high = _mm_and_si128(v, _mm_set1_epi16((short)0xFF80));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) == 0xFFFF) {
+                    _mm_storel_epi64((__m128i *)(out + o), _mm_packus_epi16(v, v));
+                    i += 16;
+                    o += 8;
+                    continue;
+                }
+            }
+            end = i + 16;
+        }
+#endif
+        for (; i + 1 < end; i += 2) {
+            unsigned u = be ? ((unsigned)p[i] << 8 | p[i + 1]) : ((unsigned)p[i + 1] << 8 | p[i]);
+            o += utf16_unit(ts, u, out + o);
+        }
+    }
+    if (i < n)
+        ts->u16_odd = p[i];
+    return o;
+}
+
+/*
+ * Feed a block of input to the text engine, transcoding it first when the
+ * input turned out to be UTF-16.
+ */
+static void text_feed(TextState *ts, const char *p, size_t n) {
+    if (n == 0)
+        return;
+    if (!ts->bom_checked) {
+        if (ts->u16_head < 0 && n == 1) {
+            ts->u16_head = (unsigned char)p[0];  /* Wait for a second byte */
+            return;
+        }
+        if (ts->u16_head >= 0) {
+            unsigned char head[2] = { (unsigned char)ts->u16_head, (unsigned char)p[0] };
+            ts->u16_head = -1;
+            utf16_decide(ts, head);
+            text_feed(ts, (const char *)head, 1);
+        } else {
+            utf16_decide(ts, (const unsigned char *)p);
+        }
+    }
+    if (ts->u16_skip) {
+        size_t k = (n < (size_t)ts->u16_skip) ? n : (size_t)ts->u16_skip;
+        p += k;
+        n -= k;
+        ts->u16_skip -= (int)k;
+    }
+    if (ts->utf16 == UTF16_NONE) {
+        text_feed_utf8(ts, p, n);
+        return;
+    }
+    if (!ts->u16_buf && !(ts->u16_buf = malloc(3 * (UTF16_CHUNK / 2 + 2))))
+        log_error("malloc failed for UTF-16 transcoder", 1);
+    while (n > 0) {
+        size_t k = (n < UTF16_CHUNK) ? n : UTF16_CHUNK;
+        text_feed_utf8(ts, ts->u16_buf, utf16_to_utf8(ts, (const unsigned char *)p, k, ts->u16_buf));
+        p += k;
+        n -= k;
+    }
+}
+
+/*
+ * True once the input is known to need no transcoding. Examines the first
+ * bytes of the input if that has not happened yet.
+ */
+static int text_is_plain(TextState *ts, const char *p, size_t n) {
+    if (!ts->bom_checked && ts->u16_head < 0 && n >= 2)
+        utf16_decide(ts, (const unsigned char *)p);
+    return ts->bom_checked && ts->utf16 == UTF16_NONE;
+}
+
+/*
+ * Flush what the text engine still holds at end of input and release it.
+ */
+static void text_finish(TextState *ts) {
+    if (ts->u16_head >= 0) {
+        /* A one-byte input is too short for a BOM */
+        char b = (char)ts->u16_head;
+        ts->u16_head = -1;
+        if (ts->utf16 == UTF16_AUTO)
+            ts->utf16 = (ts->opts->from_utf16 == UTF16_BOM) ? UTF16_LE : UTF16_NONE;
+        ts->bom_checked = 1;
+        text_feed(ts, &b, 1);
+    }
+    if (ts->u16_odd >= 0 || ts->u16_high) {
+        ts->u16_odd = -1;
+        ts->u16_high = 0;
+        text_feed_utf8(ts, "\xEF\xBF\xBD", 3);  /* U+FFFD for the truncated code unit */
+    }
+    if (ts->pending_cr) {
+        ts->pending_cr = 0;
+        limit_lines(ts, "\r", 1);
+    }
+    if (ts->ml_hold_len) {
+        int k = ts->ml_hold_len;
+        ts->ml_hold_len = 0;
+        limit_block(ts, ts->ml_hold, (size_t)k, 0);
+    }
+    if (ts->ml_dropping)
+        limit_line_end(ts);
+    if (ts->carry_len)
+        format_lines(ts, ts->carry, ts->carry_len);
+    free(ts->carry);
+    free(ts->u16_buf);
+    ts->carry = ts->u16_buf = NULL;
+    ts->carry_len = ts->carry_cap = 0;
+}
+
+/* --hex state; the dump runs continuously across all inputs */
+static struct {
+    unsigned long long start;   /* Offset of the first row (--bytes start) */
+    unsigned long long offset;  /* Input offset of the next row */
+    unsigned char row[16];      /* Partial row carried between blocks */
+    size_t row_len;
+    unsigned char prev[16];     /* Last full row written, for '*' squeezing */
+    int have_prev, squeezing;
+} hex;
+
+static const char hex_digits[] = "0123456789abcdef";
+/* A full row with its spacing, bars and newline in place, built by init_hex */
+static char hex_template[HEX_ROW_LEN];
+#ifdef __SSSE3__
+/* pshufb masks spreading the hex digits of bytes 0-7 and 8-15 over the
+ * 48-byte hex column, and the spaces left between the pairs */
+static __m128i hex_mask_lo[3], hex_mask_hi[3], hex_gaps[3];
+#endif
+
+/*
+ * Prepare the row template (and shuffle masks) for --hex; offsets start at start.
+ */
+static void init_hex(unsigned long long start) {
+    memset(hex_template, ' ', HEX_ROW_LEN);
+    hex_template[60] = hex_template[77] = '|';
+    hex_template[78] = '\n';
+    hex.start = hex.offset = start;
+#ifdef __SSSE3__
+    unsigned char lo[48], hi[48], gaps[48];
+    for (int p = 0; p < 48; p++) {
+        int q = (p < 24) ? p : p - 25;  /* Column 24 separates the two groups of 8 */
+        lo[p] = hi[p] = 0x80;
+        gaps[p] = 0;
+        if (p == 24 || q % 3 == 2)
+            gaps[p] = ' ';
+        else if (p < 24)
+            lo[p] = (unsigned char)(2 * (q / 3) + q % 3);
+        else
+            hi[p] = (unsigned char)(2 * (q / 3) + q % 3);
+    }
+    for (int v = 0; v < 3; v++) {
+        hex_mask_lo[v] = _mm_loadu_si128((const __m128i *)(lo + 16 * v));
+        hex_mask_hi[v] = _mm_loadu_si128((const __m128i *)(hi + 16 * v));
+        hex_gaps[v] = _mm_loadu_si128((const __m128i *)(gaps + 16 * v));
+    }
+#endif
+}
+
+/*
+ * Format one row of n (1-16) bytes at the current offset into out.
+ * Returns the row's length, which exceeds HEX_ROW_LEN only past 4GB.
+ */
+static size_t hex_format_row(char *out, const unsigned char *b, size_t n) {
+    size_t o = 8;
+    if (hex.offset >> 32)
+        o = (size_t)sprintf(out, "%08llx", hex.offset);
+    else
+        for (int i = 0; i < 8; i++)
+            out[i] = hex_digits[(hex.offset >> (28 - 4 * i)) & 15];
+    char *r = out + o - 8;  /* Template columns assume an 8-digit offset */
+    memcpy(r + 8, hex_template + 8, HEX_ROW_LEN - 8);
+#ifdef __SSSE3__
+    if (n == 16) {
+        const __m128i lut = _mm_loadu_si128((const __m128i *)hex_digits), nib = _mm_set1_epi8(0x0F);
+        __m128i v = _mm_loadu_si128((const __m128i *)b);
+        __m128i h = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), nib));
+        __m128i l = _mm_shuffle_epi8(lut, _mm_and_si128(v, nib));
+        __m128i d0 = _mm_unpacklo_epi8(h, l), d1 = _mm_unpackhi_epi8(h, l);
+        for (int k = 0; k < 3; k++) {
+            __m128i col = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(d0, hex_mask_lo[k]),
+                                                    _mm_shuffle_epi8(d1, hex_mask_hi[k])), hex_gaps[k]);
+            _mm_storeu_si128((__m128i *)(r + 10 + 16 * k), col);
+        }
+        /* Printable ASCII (signed compare rejects bytes >= 0x80) stays, the rest becomes '.' */
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F)));
+        __m128i gutter = _mm_or_si128(_mm_and_si128(ok, v), _mm_andnot_si128(ok, _mm_set1_epi8('.')));
+        _mm_storeu_si128((__m128i *)(r + 61), gutter);
+        return o - 8 + HEX_ROW_LEN;
+    }
+#endif
+    for (size_t k = 0; k < n; k++) {
+        char *d = r + 10 + 3 * k + (k >= 8);
+        d[0] = hex_digits[b[k] >> 4];
+        d[1] = hex_digits[b[k] & 15];
+        r[61 + k] = (b[k] >= 0x20 && b[k] < 0x7F) ? (char)b[k] : '.';
+    }
+    r[61 + n] = '|';
+    r[62 + n] = '\n';
+    return o - 8 + 63 + n;
+}
+
+/*
+ * Dump a block of raw input. Full rows are formatted straight from the block;
+ * a trailing partial row is carried to the next block. A row repeating the
+ * previous one is collapsed into a single '*' line, as hexdump does.
+ */
+static void hex_feed(const char *p, size_t n) {
+    char out[HEX_BATCH * (HEX_ROW_LEN + 8)];
+    size_t len = 0;
+    const unsigned char *u = (const unsigned char *)p;
+    while (n) {
+        const unsigned char *row;
+        if (hex.row_len || n < 16) {
+            size_t take = (16 - hex.row_len < n) ? 16 - hex.row_len : n;
+            memcpy(hex.row + hex.row_len, u, take);
+            hex.row_len += take;
+            u += take;
+            n -= take;
+            if (hex.row_len < 16)
+                break;
+            hex.row_len = 0;
+            row = hex.row;
+        } else {
+            row = u;
+            u += 16;
+            n -= 16;
+        }
+        if (hex.have_prev && !memcmp(row, hex.prev, 16)) {
+            if (!hex.squeezing) {
+                memcpy(out + len, "*\n", 2);
+                len += 2;
+                hex.squeezing = 1;
+            }
+        } else {
+            len += hex_format_row(out + len, row, 16);
+            memcpy(hex.prev, row, 16);
+            hex.have_prev = 1;
+            hex.squeezing = 0;
+        }
+        hex.offset += 16;
+        if (len > sizeof(out) - (HEX_ROW_LEN + 8)) {
+            out_write(out, len);
+            len = 0;
+        }
+    }
+    out_write(out, len);
+}
+
+/*
+ * Write the last partial row and the final offset once all inputs are dumped.
+ */
+static void hex_finish(void) {
+    char out[HEX_ROW_LEN + 8 + 24];
+    size_t len = 0;
+    if (hex.row_len) {
+        len = hex_format_row(out, hex.row, hex.row_len);
+        hex.offset += hex.row_len;
+        hex.row_len = 0;
+    }
+    if (hex.offset != hex.start)
+        len += (size_t)sprintf(out + len, "%08llx\n", hex.offset);
+    out_write(out, len);
+}
+
+/*
+ * --count. Blocks are counted on their own and merged in order, so parts of
+ * a window can be counted in parallel: a block knows the length of its first
+ * (possibly partial) line and of the partial line it ends with, which the
+ * merge joins to the block before. lines counts newlines, as wc -l does.
+ */
+typedef struct {
+    long long lines, blank, bytes, max_len;
+    long long head;       /* Bytes before the first newline, or -1 if there is none */
+    long long tail;       /* Bytes after the last newline */
+} Count;
+
+/* The current input, and the sum over all inputs */
+static Count count_file, count_all;
+
+/* Account for a newline at pos; *last is the previous one in the block, or -1 */
+static inline void count_line_end(Count *c, long long *last, long long pos) {
+    if (*last < 0) {
+        c->head = pos;
+    } else {
+        long long len = pos - *last - 1;
+        c->blank += !len;
+        if (len > c->max_len)
+            c->max_len = len;
+    }
+    *last = pos;
+}
+
+static void count_block(Count *c, const char *p, size_t n) {
+    long long last = -1;
+    size_t i = 0;
+    memset(c, 0, sizeof(*c));
+    c->head = -1;
+    c->bytes = (long long)n;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl));
+        if (!m)
+            continue;
+        c->lines += __builtin_popcount(m);
+        do {
+            count_line_end(c, &last, (long long)(i + (size_t)__builtin_ctz(m)));
+            m &= m - 1;
+        } while (m);
+    }
+#endif
+    while (i < n) {
+        const char *q = memchr(p + i, '\n', n - i);
+        if (!q)
+            break;
+        i = (size_t)(q - p);
+        c->lines++;
+        count_line_end(c, &last, (long long)i++);
+    }
+    c->tail = (long long)n - last - 1;
+}
+
+/* Append the counts of the block c to those of everything before it */
+static void count_merge(Count *acc, const Count *c) {
+    if (c->head < 0) {
+        acc->tail += c->tail;
+    } else {
+        long long first = acc->tail + c->head;
+        acc->blank += !first;
+        if (first > acc->max_len)
+            acc->max_len = first;
+        acc->tail = c->tail;
+    }
+    acc->lines += c->lines;
+    acc->blank += c->blank;
+    acc->bytes += c->bytes;
+    if (c->max_len > acc->max_len)
+        acc->max_len = c->max_len;
+}
+
+static void count_feed(const char *p, size_t n) {
+    Count c;
+    count_block(&c, p, n);
+    count_merge(&count_file, &c);
+}
+
+/*
+ * Write one --count line (tab separated: lines, nonblank lines, bytes,
+ * longest line, name). An unterminated last line still counts for the
+ * longest line. Input counts are added to the total.
+ */
+static void count_report(Count *c, const char *name) {
+    if (c->tail > c->max_len)
+        c->max_len = c->tail;
+    out_printf("%lld\t%lld\t%lld\t%lld\t", c->lines, c->lines - c->blank, c->bytes, c->max_len);
+    out_write(name, strlen(name));  /* Too long for out_printf's buffer, for deep paths */
+    out_putc('\n');
+    if (c != &count_all) {
+        count_all.lines += c->lines;
+        count_all.blank += c->blank;
+        count_all.bytes += c->bytes;
+        if (c->max_len > count_all.max_len)
+            count_all.max_len = c->max_len;
+    }
+}
+
+/*
+ * Read whatever is available from a stream's descriptor, like read(2).
+ * Unlike fread this returns as soon as a pipe or terminal has data.
+ */
+static long read_some(FILE *f, char *buf, size_t cap) {
+#ifdef _WIN32
+    return _read(_fileno(f), buf, (unsigned)cap);
+#else
+    ssize_t n;
+    do {
+        n = read(fileno(f), buf, cap);
+    } while (n < 0 && errno == EINTR);
+    return (long)n;
+#endif
+}
+
+/*
+ * Discard the first n bytes of an input that cannot seek (--bytes start).
+ * Returns -1 on a read error.
+ */
+static int skip_input(int fd, long long n) {
+    char buf[BUFSIZE];
+    while (n > 0) {
+        unsigned want = (n < BUFSIZE) ? (unsigned)n : BUFSIZE;
+#ifdef _WIN32
+        int r = _read(fd, buf, want);
+#else
+        ssize_t r = read(fd, buf, want);
+        if (r < 0 && errno == EINTR)
+            continue;
+#endif
+        if (r <= 0)
+            return (r < 0) ? -1 : 0;
+        n -= r;
+    }
+    return 0;
+}
+
+/*
+ * Read up to cap bytes for format detection, retrying the short reads a pipe
+ * may return. Returns the number of bytes read.
+ */
+static size_t read_head(int fd, char *buf, size_t cap) {
+    size_t got = 0;
+    while (got < cap) {
+#ifdef _WIN32
+        int r = _read(fd, buf + got, (unsigned)(cap - got));
+#else
+        ssize_t r = read(fd, buf + got, cap - got);
+        if (r < 0 && errno == EINTR)
+            continue;
+#endif
+        if (r <= 0)
+            break;
+        got += (size_t)r;
+    }
+    return got;
+}
+
+/* Clamp a read to what is left of a --bytes range (left < 0: unlimited) */
+static size_t clamp_read(long long left, size_t cap) {
+    return (left >= 0 && (unsigned long long)left < cap) ? (size_t)left : cap;
+}
+
+/*
+ * Process a text stream through the text engine, starting with head_len bytes
+ * already read from it, then reading at most limit bytes (limit < 0: until EOF).
+ * Input is read in blocks and split with memchr, so NUL bytes survive.
+ */
+static void process_text(FILE *f, const char *head, size_t head_len, Options *opts, int *line_no,
+                         long long limit) {
+    char buf[BUFSIZE];
+    TextState ts;
+    text_init(&ts, opts, line_no);
+    if (head_len) {
+        digest_input(head, head_len);
+        text_feed(&ts, head, head_len);
+    }
+    long n = 0;
+    size_t cap;
+    while ((cap = clamp_read(limit, sizeof(buf))) && (n = read_some(f, buf, cap)) > 0) {
+        if (limit > 0)
+            limit -= n;
+        digest_input(buf, (size_t)n);
+        text_feed(&ts, buf, (size_t)n);
+    }
+    if (n < 0)
+        log_error("Error reading file", 0);
+    text_finish(&ts);
+}
+
+/*
+ * Process a stream in binary mode with minimal overhead, like process_text:
+ * head first, then at most limit bytes. With --hex the bytes are dumped instead,
+ * and with --count only counted.
+ */
+static void process_binary(FILE *f, const char *head, size_t head_len, Options *opts, long long limit) {
+    char buf[BUFSIZE];
+    long n = 0;
+    size_t cap;
+    if (head_len) {
+        digest_input(head, head_len);
+        if (opts->hex)
+            hex_feed(head, head_len);
+        else if (opts->count)
+            count_feed(head, head_len);
+        else
+            out_write(head, head_len);
+    }
+    while ((cap = clamp_read(limit, sizeof(buf))) && (n = read_some(f, buf, cap)) > 0) {
+        if (limit > 0)
+            limit -= n;
+        digest_input(buf, (size_t)n);
+        if (opts->hex) {
+            hex_feed(buf, (size_t)n);
+        } else if (opts->count) {
+            count_feed(buf, (size_t)n);
+        } else if (out_write(buf, (size_t)n) != (size_t)n) {
+            log_error("fwrite failed in process_binary", 0);
+            break;
+        }
+    }
+    if (n < 0)
+        log_error("Error reading binary file", 0);
+}
+
+/*
+ * Identify a compressed stream from its first bytes. Only the formats cc was
+ * built with (CC_HAVE_ZLIB, CC_HAVE_ZSTD) are recognized.
+ */
+static int compression_of(const unsigned char *p, size_t n) {
+#ifdef CC_HAVE_ZLIB
+    if (n >= 2 && p[0] == 0x1F && p[1] == 0x8B)
+        return COMP_GZIP;
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (n >= 4 && read_le32(p) == ZSTD_MAGICNUMBER)
+        return COMP_ZSTD;
+#endif
+    (void)p; (void)n;
+    return COMP_NONE;
+}
+
+/*
+ * True when inputs should be checked for compression: always with
+ * --decompress, and by default only when text is formatted, so a raw copy of
+ * a .gz file stays byte-for-byte identical.
+ */
+static int wants_decompress(const Options *opts, int use_text) {
+#ifdef CC_HAVE_DECOMPRESS
+    return opts->decompress == DECOMP_ALWAYS || (opts->decompress == DECOMP_AUTO && use_text);
+#else
+    (void)opts; (void)use_text;
+    return 0;
+#endif
+}
+
+#ifdef CC_HAVE_DECOMPRESS
+/*
+ * One compressed input being decoded. A reader thread decompresses into the
+ * slots of a small ring buffer while the calling thread runs the slots through
+ * the text engine (or --hex, or straight to the output), so decompression and
+ * formatting overlap. Without threads the slots are consumed as they fill.
+ */
+typedef struct {
+    int fd;
+    int kind;                   /* COMP_GZIP or COMP_ZSTD */
+    const char *head;           /* Bytes already read while detecting the format */
+    size_t head_len;
+    long long limit;            /* Compressed bytes left to read (--bytes), or -1 */
+    const char *error;          /* Set by the reader on corrupt or truncated input */
+    TextState *ts;
+    int text_mode;
+    char *slot[RING_SLOTS];
+    size_t slot_len[RING_SLOTS];
+    int rd, wr, count, finished, threaded;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} Decoder;
+
+/* Hand decompressed bytes to the engine the input would have used */
+static void decoded_write(TextState *ts, int text_mode, const char *p, size_t n) {
+    if (text_mode)
+        text_feed(ts, p, n);
+    else if (ts->opts->hex)
+        hex_feed(p, n);
+    else if (ts->opts->count)
+        count_feed(p, n);
+    else
+        out_write(p, n);
+}
+
+/* Read compressed input: the detected head first, then the descriptor */
+static long decoder_read(Decoder *d, char *buf, size_t cap) {
+    long n;
+    cap = clamp_read(d->limit, cap);
+    if (!cap)
+        return 0;
+    if (d->head_len) {
+        n = (long)((d->head_len < cap) ? d->head_len : cap);
+        memcpy(buf, d->head, (size_t)n);
+        d->head += n;
+        d->head_len -= (size_t)n;
+    } else {
+#ifdef _WIN32
+        n = _read(d->fd, buf, (unsigned)cap);
+#else
+        do {
+            n = (long)read(d->fd, buf, cap);
+        } while (n < 0 && errno == EINTR);
+#endif
+    }
+    if (n > 0) {
+        if (d->limit > 0)
+            d->limit -= n;
+        digest_input(buf, (size_t)n);
+    }
+    return n;
+}
+
+/* Wait for a free slot and return it for the reader to fill */
+static char *ring_acquire(Decoder *d) {
+#ifndef _WIN32
+    if (d->threaded) {
+        pthread_mutex_lock(&d->lock);
+        while (d->count == RING_SLOTS)
+            pthread_cond_wait(&d->cond, &d->lock);
+        pthread_mutex_unlock(&d->lock);
+    }
+#endif
+    return d->slot[d->wr];
+}
+
+/* Publish the slot being filled, holding n bytes */
+static void ring_publish(Decoder *d, size_t n) {
+    if (!n)
+        return;
+    if (!d->threaded) {
+        decoded_write(d->ts, d->text_mode, d->slot[d->wr], n);
+        return;
+    }
+#ifndef _WIN32
+    pthread_mutex_lock(&d->lock);
+    d->slot_len[d->wr] = n;
+    d->wr = (d->wr + 1) % RING_SLOTS;
+    d->count++;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+#endif
+}
+
+#ifdef CC_HAVE_ZLIB
+/* Stream a gzip input; concatenated members are decoded one after another */
+static void decode_gzip(Decoder *d) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 16) != Z_OK) { d->error = "inflateInit failed"; return; }
+    unsigned char in[8 * BUFSIZE];
+    char *out = ring_acquire(d);
+    size_t used = 0;
+    int eof = 0;
+    for (;;) {
+        if (z.avail_in == 0 && !eof) {
+            long n = decoder_read(d, (char *)in, sizeof(in));
+            if (n < 0) { d->error = "Error reading compressed input"; break; }
+            eof = (n == 0);
+            z.next_in = in;
+            z.avail_in = (uInt)(n > 0 ? n : 0);
+        }
+        z.next_out = (Bytef *)out + used;
+        z.avail_out = (uInt)(RING_SLOT - used);
+        int ret = inflate(&z, Z_NO_FLUSH);
+        used = RING_SLOT - z.avail_out;
+        if (used == RING_SLOT) {
+            ring_publish(d, used);
+            out = ring_acquire(d);
+            used = 0;
+        }
+        if (ret == Z_STREAM_END) {
+            /* Another member may follow */
+            if (z.avail_in == 0 && !eof) {
+                long n = decoder_read(d, (char *)in, sizeof(in));
+                if (n < 0) { d->error = "Error reading compressed input"; break; }
+                eof = (n == 0);
+                z.next_in = in;
+                z.avail_in = (uInt)(n > 0 ? n : 0);
+            }
+            /* Zero padding (tar, tape) after the last member ends the input, as with gzip -d */
+            while (z.avail_in > 0 && *z.next_in == 0) {
+                z.next_in++;
+                if (--z.avail_in == 0 && !eof) {
+                    long n = decoder_read(d, (char *)in, sizeof(in));
+                    if (n < 0) { d->error = "Error reading compressed input"; break; }
+                    eof = (n == 0);
+                    z.next_in = in;
+                    z.avail_in = (uInt)(n > 0 ? n : 0);
+                }
+            }
+            if (z.avail_in == 0)
+                break;
+            inflateReset(&z);
+        } else if (ret == Z_BUF_ERROR && eof && z.avail_in == 0) {
+            d->error = "Truncated gzip input";
+            break;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            d->error = "Invalid gzip data";
+            break;
+        }
+    }
+    ring_publish(d, used);
+    inflateEnd(&z);
+}
+#endif
+
+#ifdef CC_HAVE_ZSTD
+/* Stream a zstd input; ZSTD_decompressStream moves across frames by itself */
+static void decode_zstd(Decoder *d) {
+    ZSTD_DStream *zs = ZSTD_createDStream();
+    if (!zs) { d->error = "ZSTD_createDStream failed"; return; }
+    char in[8 * BUFSIZE];
+    ZSTD_inBuffer ib = { in, 0, 0 };
+    ZSTD_outBuffer ob = { ring_acquire(d), RING_SLOT, 0 };
+    size_t r = 0;
+    int eof = 0;
+    for (;;) {
+        if (ib.pos == ib.size && !eof) {
+            long n = decoder_read(d, in, sizeof(in));
+            if (n < 0) { d->error = "Error reading compressed input"; break; }
+            eof = (n == 0);
+            ib.size = (size_t)(n > 0 ? n : 0);
+            ib.pos = 0;
+        }
+        size_t consumed = ib.pos, produced = ob.pos;
+        size_t ret = ZSTD_decompressStream(zs, &ob, &ib);
+        if (ZSTD_isError(ret)) { d->error = "Invalid zstd data"; break; }
+        if (ib.pos != consumed || ob.pos != produced)
+            r = ret;  /* 0 once a frame is complete; an idle call would start the next one */
+        if (ob.pos == ob.size) {
+            ring_publish(d, ob.pos);
+            ob.dst = ring_acquire(d);
+            ob.pos = 0;
+        } else if (eof && ib.pos == ib.size && ob.pos == produced) {
+            if (r != 0)
+                d->error = "Truncated zstd input";
+            break;
+        }
+    }
+    ring_publish(d, ob.pos);
+    ZSTD_freeDStream(zs);
+}
+#endif
+
+static void *decoder_run(void *arg) {
+    Decoder *d = arg;
+#ifdef CC_HAVE_ZLIB
+    if (d->kind == COMP_GZIP)
+        decode_gzip(d);
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (d->kind == COMP_ZSTD)
+        decode_zstd(d);
+#endif
+#ifndef _WIN32
+    if (d->threaded) {
+        pthread_mutex_lock(&d->lock);
+        d->finished = 1;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+    }
+#endif
+    return NULL;
+}
+
+/*
+ * Decode a compressed stream read from fd (after the head bytes already taken
+ * from it) and run the result through the engines. Returns -1 on corrupt input.
+ */
+static int decode_stream(int fd, int kind, const char *head, size_t head_len, long long limit,
+                         int text_mode, TextState *ts) {
+    Decoder d;
+    memset(&d, 0, sizeof(d));
+    d.fd = fd;
+    d.kind = kind;
+    d.head = head;
+    d.head_len = head_len;
+    d.limit = limit;
+    d.ts = ts;
+    d.text_mode = text_mode;
+    for (int i = 0; i < RING_SLOTS; i++)
+        if (!(d.slot[i] = malloc(RING_SLOT))) log_error("malloc failed for the decompression ring", 1);
+#ifndef _WIN32
+    pthread_t tid;
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.cond, NULL);
+    d.threaded = 1;  /* Set before the reader starts, which checks it */
+    if (pthread_create(&tid, NULL, decoder_run, &d) != 0)
+        d.threaded = 0;
+    if (d.threaded) {
+        for (;;) {
+            pthread_mutex_lock(&d.lock);
+            while (d.count == 0 && !d.finished)
+                pthread_cond_wait(&d.cond, &d.lock);
+            if (d.count == 0) {
+                pthread_mutex_unlock(&d.lock);
+                break;
+            }
+            int slot = d.rd;
+            pthread_mutex_unlock(&d.lock);
+            decoded_write(ts, text_mode, d.slot[slot], d.slot_len[slot]);
+            pthread_mutex_lock(&d.lock);
+            d.rd = (d.rd + 1) % RING_SLOTS;
+            d.count--;
+            pthread_cond_broadcast(&d.cond);
+            pthread_mutex_unlock(&d.lock);
+        }
+        pthread_join(tid, NULL);
+    }
+    pthread_mutex_destroy(&d.lock);
+    pthread_cond_destroy(&d.cond);
+#endif
+    if (!d.threaded)
+        decoder_run(&d);
+    for (int i = 0; i < RING_SLOTS; i++)
+        free(d.slot[i]);
+    if (d.error) {
+        errno = EINVAL;
+        log_error(d.error, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Decode a compressed stream that cannot seek, such as a pipe, whose first
+ * head_len bytes were read to detect the format.
+ */
+static void process_compressed_stream(int fd, int kind, const char *head, size_t head_len, long long limit,
+                                      int text_mode, Options *opts, int *line_no) {
+    TextState ts;
+    text_init(&ts, opts, line_no);
+    decode_stream(fd, kind, head, head_len, limit, text_mode, &ts);
+    text_finish(&ts);
+}
+
+#ifndef _WIN32
+/* One member of a multi-member input, decoded as a unit by the parallel engine */
+typedef struct {
+    off_t off;
+    size_t csize, usize;        /* Compressed and decompressed sizes */
+    char *in, *out;
+    int ok;
+} Member;
+
+/* Members shared by the parallel workers, handed out in order */
+typedef struct {
+    int fd, kind;
+    Member *m;
+    int count, next;
+    pthread_mutex_t lock;
+} MemberBatch;
+
+static int pread_full(int fd, char *buf, size_t n, off_t off) {
+    while (n) {
+        ssize_t r = pread(fd, buf, n, off);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        buf += r;
+        n -= (size_t)r;
+        off += r;
+    }
+    return 0;
+}
+
+/*
+ * Size the member at pos without decompressing it: a BGZF block records its
+ * compressed size in the gzip header and its decompressed size in the
+ * trailer; a zstd frame records its content size in the frame header and is
+ * walked block by block for its compressed size. Returns -1 for anything else,
+ * or for members larger than MEMBER_MAX.
+ */
+static int member_scan(int fd, int kind, off_t pos, off_t end, size_t *csize, size_t *usize) {
+    unsigned char h[18];
+    if (end - pos < 18 || pread_full(fd, (char *)h, sizeof(h), pos) < 0)
+        return -1;
+#ifdef CC_HAVE_ZLIB
+    if (kind == COMP_GZIP) {
+        unsigned char t[4];
+        if (h[0] != 0x1F || h[1] != 0x8B || h[2] != 8 || !(h[3] & 4) || h[10] < 6 || h[11] ||
+            h[12] != 'B' || h[13] != 'C' || h[14] != 2 || h[15])
+            return -1;
+        *csize = (size_t)(h[16] | h[17] << 8) + 1;
+        if ((off_t)*csize > end - pos || pread_full(fd, (char *)t, 4, pos + (off_t)*csize - 4) < 0)
+            return -1;
+        *usize = read_le32(t);
+        return 0;
+    }
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (kind == COMP_ZSTD) {
+        static const int dict_len[4] = { 0, 1, 2, 4 }, fcs_len[4] = { 0, 2, 4, 8 };
+        if (read_le32(h) != ZSTD_MAGICNUMBER)
+            return -1;
+        unsigned long long content = ZSTD_getFrameContentSize(h, sizeof(h));
+        if (content == ZSTD_CONTENTSIZE_UNKNOWN || content == ZSTD_CONTENTSIZE_ERROR || content > MEMBER_MAX)
+            return -1;
+        int single = (h[4] >> 5) & 1, fcs = h[4] >> 6;
+        off_t p = pos + 5 + !single + dict_len[h[4] & 3] + ((fcs == 0 && single) ? 1 : fcs_len[fcs]);
+        for (;;) {
+            unsigned char b[3];
+            if (end - p < 3 || pread_full(fd, (char *)b, 3, p) < 0)
+                return -1;
+            unsigned bh = b[0] | b[1] << 8 | (unsigned)b[2] << 16, type = (bh >> 1) & 3;
+            if (type == 3)
+                return -1;
+            p += 3 + ((type == 1) ? 1 : (bh >> 3));
+            if (bh & 1)
+                break;
+        }
+        if (h[4] & 4)
+            p += 4;  /* Content checksum */
+        if (p > end || p - pos > MEMBER_MAX)
+            return -1;
+        *csize = (size_t)(p - pos);
+        *usize = (size_t)content;
+        return 0;
+    }
+#endif
+    (void)kind; (void)csize; (void)usize;
+    return -1;
+}
+
+static void *member_worker(void *arg) {
+    MemberBatch *b = arg;
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        int i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->count)
+            break;
+        Member *m = &b->m[i];
+        m->in = malloc(m->csize);
+        m->out = malloc(m->usize ? m->usize : 1);
+        if (!m->in || !m->out || pread_full(b->fd, m->in, m->csize, m->off) < 0)
+            continue;
+#ifdef CC_HAVE_ZLIB
+        if (b->kind == COMP_GZIP) {
+            z_stream z;
+            memset(&z, 0, sizeof(z));
+            if (inflateInit2(&z, 15 + 16) != Z_OK)
+                continue;
+            z.next_in = (Bytef *)m->in;
+            z.avail_in = (uInt)m->csize;
+            z.next_out = (Bytef *)m->out;
+            z.avail_out = (uInt)m->usize;
+            m->ok = (inflate(&z, Z_FINISH) == Z_STREAM_END && z.total_out == m->usize && z.avail_in == 0);
+            inflateEnd(&z);
+        }
+#endif
+#ifdef CC_HAVE_ZSTD
+        if (b->kind == COMP_ZSTD)
+            m->ok = (ZSTD_decompress(m->out, m->usize, m->in, m->csize) == m->usize);
+#endif
+    }
+    return NULL;
+}
+
+/*
+ * Parallel engine for regular files made of self-sizing members (see
+ * member_scan): batches of members are decoded on one thread per CPU and
+ * emitted in order. Returns the offset where it stopped, which is before end
+ * when a member cannot be sized; the streaming decoder takes over from there.
+ * *failed is set on corrupt data.
+ */
+static off_t decode_members(int fd, int kind, off_t off, off_t end, int text_mode, TextState *ts, int *failed) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = (ncpu > MEMBER_THREADS) ? MEMBER_THREADS : (int)ncpu;
+    if (nthreads < 2)
+        return off;
+    MemberBatch b;
+    b.fd = fd;
+    b.kind = kind;
+    if (!(b.m = malloc(sizeof(Member) * MEMBER_BATCH)))
+        return off;
+    pthread_mutex_init(&b.lock, NULL);
+    while (off < end && !*failed) {
+        size_t bytes = 0;
+        off_t pos = off;
+        b.count = b.next = 0;
+        while (b.count < MEMBER_BATCH && bytes < MEMBER_BATCH_BYTES && pos < end) {
+            Member *m = &b.m[b.count];
+            if (member_scan(fd, kind, pos, end, &m->csize, &m->usize) < 0)
+                break;
+            m->off = pos;
+            m->in = m->out = NULL;
+            m->ok = 0;
+            pos += (off_t)m->csize;
+            bytes += m->usize;
+            b.count++;
+        }
+        if (!b.count)
+            break;
+        pthread_t tid[MEMBER_THREADS];
+        int started = 0;
+        while (started < nthreads - 1 && started < b.count &&
+               pthread_create(&tid[started], NULL, member_worker, &b) == 0)
+            started++;
+        member_worker(&b);
+        for (int i = 0; i < started; i++)
+            pthread_join(tid[i], NULL);
+        for (int i = 0; i < b.count; i++) {
+            Member *m = &b.m[i];
+            if (!*failed && !m->ok) {
+                errno = EINVAL;
+                log_error("Invalid compressed data", 0);
+                *failed = 1;
+            }
+            if (!*failed) {
+                digest_input(m->in, m->csize);
+                decoded_write(ts, text_mode, m->out, m->usize);
+                off += (off_t)m->csize;
+            }
+            free(m->in);
+            free(m->out);
+        }
+    }
+    pthread_mutex_destroy(&b.lock);
+    free(b.m);
+    return off;
+}
+
+/*
+ * Decode a compressed regular file from off up to end (end < 0: EOF):
+ * member-parallel where the format allows, streaming otherwise.
+ * Returns the offset up to which the file was consumed.
+ */
+static off_t process_compressed_file(int fd, int kind, off_t off, off_t end, off_t size,
+                                     int text_mode, Options *opts, int *line_no) {
+    TextState ts;
+    int failed = 0;
+    off_t stop = (end >= 0 && end < size) ? end : size;
+    text_init(&ts, opts, line_no);
+    off = decode_members(fd, kind, off, stop, text_mode, &ts, &failed);
+    if (!failed && off < stop) {
+        if (lseek(fd, off, SEEK_SET) < 0)
+            log_error("lseek failed on compressed input", 0);
+        else
+            decode_stream(fd, kind, NULL, 0, (end < 0) ? -1 : (long long)(end - off), text_mode, &ts);
+        off = lseek(fd, 0, SEEK_CUR);
+    }
+    text_finish(&ts);
+    return off;
+}
+#endif
+#endif
+
+#ifdef _WIN32
+/*
+ * Process file using memory mapping on Windows.
+ * Mapped files cannot be truncated on Windows, so the whole file is mapped at once.
+ */
+static void process_file_mmap(const char *fname, int text_mode, Options *opts, int *line_no) {
+    HANDLE hFile = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) { log_error("Error opening file", 0); return; }
+    LARGE_INTEGER fsize;
+    if (!GetFileSizeEx(hFile, &fsize)) { log_error("GetFileSizeEx failed", 0); CloseHandle(hFile); return; }
+    if (fsize.QuadPart == 0) { CloseHandle(hFile); return; }
+    HANDLE hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!hMap) { log_error("CreateFileMapping failed", 0); CloseHandle(hFile); return; }
+    char *data = (char*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+    if (!data) { log_error("MapViewOfFile failed", 0); CloseHandle(hMap); CloseHandle(hFile); return; }
+    long long end = (opts->range_end >= 0 && opts->range_end < fsize.QuadPart) ? opts->range_end : fsize.QuadPart;
+    long long start = (opts->range_start < end) ? opts->range_start : end;
+    size_t size = (size_t)(end - start);
+    digest_input(data + start, size);
+    if (!text_mode) {
+        if (opts->hex)
+            hex_feed(data + start, size);
+        else if (opts->count)
+            count_feed(data + start, size);
+        else if (out_write(data + start, size) != size)
+            log_error("fwrite failed in mmap binary mode", 0);
+    } else {
+        TextState ts;
+        text_init(&ts, opts, line_no);
+        text_feed(&ts, data + start, size);
+        text_finish(&ts);
+    }
+    UnmapViewOfFile(data);
+    CloseHandle(hMap);
+    CloseHandle(hFile);
+}
+
+/*
+ * True if a named file starts (at the --bytes start) with a compressed format.
+ */
+static int file_is_compressed(const char *fname, long long start) {
+    unsigned char head[4];
+    FILE *f = fopen(fname, "rb");
+    if (!f) return 0;
+    size_t n = (_fseeki64(f, start, SEEK_SET) == 0) ? fread(head, 1, sizeof(head), f) : 0;
+    fclose(f);
+    return compression_of(head, n) != COMP_NONE;
+}
+
+/*
+ * Pick an engine for one input: memory mapping for large named files,
+ * stdio otherwise; compressed input is decoded from the stream.
+ */
+static void process_input(const char *fname, int use_text, Options *opts, int *line_no) {
+    int decompress = wants_decompress(opts, use_text);
+    if (strcmp(fname, "-") && get_file_size(fname) >= MMAP_THRESHOLD &&
+        !(decompress && file_is_compressed(fname, opts->range_start))) {
+        process_file_mmap(fname, use_text, opts, line_no);
+        return;
+    }
+    FILE *f = (strcmp(fname, "-") ? fopen(fname, (use_text && !decompress) ? "r" : "rb") : stdin);
+    if (!f) { log_error(fname, 0); return; }
+    long long limit = (opts->range_end < 0) ? -1 : opts->range_end - opts->range_start;
+    char head[4];
+    size_t head_len = 0;
+    int kind = COMP_NONE;
+    if (skip_input(_fileno(f), opts->range_start) < 0) {
+        log_error("Error skipping to --bytes start", 0);
+    } else {
+        if (decompress) {
+            head_len = read_head(_fileno(f), head, clamp_read(limit, sizeof(head)));
+            kind = compression_of((const unsigned char *)head, head_len);
+            if (limit > 0 && kind == COMP_NONE)
+                limit -= (long long)head_len;
+        }
+#ifdef CC_HAVE_DECOMPRESS
+        if (kind != COMP_NONE)
+            process_compressed_stream(_fileno(f), kind, head, head_len, limit, use_text, opts, line_no);
+        else
+#endif
+        if (use_text)
+            process_text(f, head, head_len, opts, line_no, limit);
+        else
+            process_binary(f, head, head_len, opts, limit);
+    }
+    if (f != stdin && fclose(f) != 0)
+        log_error("Failed to close input file", 0);
+}
+#else
+#ifdef __linux__
+/*
+ * Copy an input straight to stdout inside the kernel, starting at *off for a
+ * regular file (NULL off for a pipe) and running for len bytes, or until EOF
+ * if len is negative.
+ * Regular-file output uses copy_file_range, a pipe on either side uses splice,
+ * and anything else uses sendfile.
+ * Returns 0 when done, or -1 if the kernel refused the combination; the caller
+ * then falls back to a userspace engine from *off.
+ */
+/*
+ * --tee inside the kernel: each chunk is spliced into a pipe, duplicated with
+ * tee(2) into an empty scratch pipe of the same size for every tee and
+ * spliced on from there, and finally spliced to standard output.
+ */
+static struct {
+    int ready;
+    int mid[2], scratch[2], null_fd;
+    size_t cap;
+} fan;
+
+/*
+ * Move n bytes out of the pipe rd into fd. Outputs that do not take splice
+ * (a terminal, say) are written from a buffer instead. With droppable, what
+ * a full non-blocking fd has no room for is discarded and added to *dropped.
+ * Returns -1 with errno set when the rest had to be discarded.
+ */
+static int pipe_drain(int rd, int fd, size_t n, int droppable, long long *dropped) {
+    char buf[BUFSIZE];
+    while (n > 0) {
+        ssize_t k = splice(rd, NULL, fd, NULL, n, SPLICE_F_MOVE | (droppable ? SPLICE_F_NONBLOCK : 0));
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k < 0 && errno == EAGAIN && !droppable) {
+            struct pollfd w = { .fd = fd, .events = POLLOUT };
+            poll(&w, 1, -1);
+            continue;
+        }
+        if (k < 0 && errno == EINVAL) {
+            k = read(rd, buf, n < sizeof(buf) ? n : sizeof(buf));
+            if (k > 0) {
+                size_t w = write_fd(fd, buf, (size_t)k, droppable);
+                *dropped += (long long)((size_t)k - w);
+                if (w < (size_t)k && errno == EPIPE) {
+                    n -= (size_t)k;
+                    k = -1;
+                }
+            }
+        }
+        if (k <= 0) {
+            int err = errno;
+            if (k < 0 && err == EPIPE && fd == STDOUT_FILENO)
+                stdout_closed();
+            if (!(k < 0 && (err == EAGAIN || err == EPIPE)))
+                log_error("splice failed for --tee", 0);
+            /* The pipe must be emptied either way */
+            *dropped += (long long)n;
+            while (n > 0 && (k = splice(rd, NULL, fan.null_fd, NULL, n, SPLICE_F_MOVE)) > 0)
+                n -= (size_t)k;
+            errno = err;
+            return -1;
+        }
+        n -= (size_t)k;
+    }
+    return 0;
+}
+
+static int fan_init(void) {
+    if (!fan.ready) {
+        fan.ready = -1;
+        if (pipe2(fan.mid, O_CLOEXEC) < 0)
+            return -1;
+        if (pipe2(fan.scratch, O_CLOEXEC) < 0 || (fan.null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0) {
+            close(fan.mid[0]);
+            close(fan.mid[1]);
+            return -1;
+        }
+        fcntl(fan.mid[1], F_SETPIPE_SZ, ZEROCOPY_CHUNK);
+        fcntl(fan.scratch[1], F_SETPIPE_SZ, ZEROCOPY_CHUNK);
+        int a = fcntl(fan.mid[1], F_GETPIPE_SZ), b = fcntl(fan.scratch[1], F_GETPIPE_SZ);
+        /* Both pipes hold the same amount, so one tee(2) copies a whole chunk */
+        fan.cap = (size_t)(a < b ? a : b);
+        fan.ready = a > 0 && b > 0 ? 1 : -1;
+    }
+    return fan.ready > 0 ? 0 : -1;
+}
+
+static int copy_fd_fanout(int fd, off_t *off, off_t len) {
+    if (fan_init() < 0)
+        return -1;
+    long long out_dropped = 0;
+    while (len != 0) {
+        loff_t pos = off ? *off : 0;
+        size_t chunk = (len > 0 && (size_t)len < fan.cap) ? (size_t)len : fan.cap;
+        ssize_t n = splice(fd, off ? &pos : NULL, fan.mid[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0)
+            return 0;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL || errno == ENOSYS)
+                return -1;
+            log_error("zero-copy output failed", 0);
+            return 0;
+        }
+        for (int i = 0; i < tee_out.count; i++) {
+            if (tee_out.fd[i] < 0) {
+                tee_out.dropped[i] += n;
+                continue;
+            }
+            ssize_t t;
+            do {
+                t = tee(fan.mid[0], fan.scratch[1], (size_t)n, 0);
+            } while (t < 0 && errno == EINTR);
+            if (t > 0 && pipe_drain(fan.scratch[0], tee_out.fd[i], (size_t)t, tee_out.policy == TEE_DROP,
+                                    &tee_out.dropped[i]) < 0 && errno == EPIPE)
+                tee_retire(i);
+            tee_out.dropped[i] += n - (t > 0 ? t : 0);
+        }
+        if (pipe_drain(fan.mid[0], STDOUT_FILENO, (size_t)n, 0, &out_dropped) < 0)
+            return 0;
+        if (off)
+            *off = pos;
+        if (len > 0)
+            len -= n;
+        progress_add((size_t)n);
+    }
+    return 0;
+}
+
+static int copy_fd_zerocopy(int fd, off_t *off, off_t len) {
+    struct stat ost;
+    tee_flush();
+    if (fflush(stdout) != 0) { log_error("fflush failed before zero-copy output", 0); return 0; }
+    if (tee_out.count)
+        return copy_fd_fanout(fd, off, len);
+    if (fstat(STDOUT_FILENO, &ost) < 0) return -1;
+    while (len != 0) {
+        ssize_t n;
+        loff_t pos = off ? *off : 0;
+        size_t chunk = (len > 0 && len < ZEROCOPY_CHUNK) ? (size_t)len : ZEROCOPY_CHUNK;
+        if (!off || S_ISFIFO(ost.st_mode))
+            n = splice(fd, off ? &pos : NULL, STDOUT_FILENO, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        else if (S_ISREG(ost.st_mode))
+            n = copy_file_range(fd, &pos, STDOUT_FILENO, NULL, chunk, 0);
+        else
+            n = sendfile(STDOUT_FILENO, fd, &pos, chunk);
+        if (n == 0)
+            return 0;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+                errno == EOPNOTSUPP || errno == EBADF)
+                return -1;
+            log_error("zero-copy output failed", 0);
+            return 0;
+        }
+        if (off)
+            *off = pos;
+        if (len > 0)
+            len -= n;
+        progress_add((size_t)n);
+    }
+    return 0;
+}
+
+/* A range of a regular file hashed by a helper thread during a zero-copy run */
+typedef struct {
+    int fd;
+    off_t pos, end;       /* Next offset to hash, and where to stop */
+    Digest in, out;       /* Private copies of in_digest and out_digest */
+} DigestJob;
+
+static void *digest_job_run(void *arg) {
+    DigestJob *job = arg;
+    char *buf = malloc(ZEROCOPY_CHUNK);
+    if (!buf)
+        return NULL;
+    while (job->pos < job->end) {
+        size_t want = (job->end - job->pos < ZEROCOPY_CHUNK) ? (size_t)(job->end - job->pos) : ZEROCOPY_CHUNK;
+        ssize_t n = pread(job->fd, buf, want, job->pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        if (in_tap)
+            digest_update(&job->in, buf, (size_t)n);
+        if (out_tap)
+            digest_update(&job->out, buf, (size_t)n);
+        job->pos += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * copy_fd_zerocopy for a regular file (size bytes long) whose data also has to
+ * be hashed. The kernel copies while a helper thread reads the same range back
+ * from the page cache; as raw output equals the input, the thread feeds the
+ * output digest too. If the copy ends anywhere but where the thread did (the
+ * file changed, or the kernel refused part way), the copied range is hashed
+ * again here so the digests match what was written.
+ */
+static int copy_fd_digested(int fd, off_t *off, off_t len, off_t size) {
+    if (!in_tap && !out_tap)
+        return copy_fd_zerocopy(fd, off, len);
+    off_t begin = *off;
+    DigestJob job = { fd, begin, (len >= 0 && begin + len < size) ? begin + len : size, in_digest, out_digest };
+    pthread_t tid;
+    int threaded = (pthread_create(&tid, NULL, digest_job_run, &job) == 0);
+    int r = copy_fd_zerocopy(fd, off, len);
+    if (threaded)
+        pthread_join(tid, NULL);
+    if (!threaded || job.pos != *off) {
+        DigestJob redo = { fd, begin, *off, in_digest, out_digest };
+        digest_job_run(&redo);
+        job = redo;
+    }
+    in_digest = job.in;
+    out_digest = job.out;
+    return r;
+}
+#endif
+
+/*
+ * Recovery point for a SIGBUS raised while a mapped window is being read.
+ * Per thread, as --count reads parts of a window on several.
+ */
+static __thread sigjmp_buf mmap_fault_env;
+static __thread volatile sig_atomic_t mmap_fault_armed = 0;
+
+/*
+ * SIGBUS handler for mapped reads.
+ * A fault inside an armed window means the file was truncated underneath us,
+ * so unwind back to the reader; any other SIGBUS keeps its default action.
+ */
+static void handle_sigbus(int sig) {
+    if (mmap_fault_armed) {
+        mmap_fault_armed = 0;
+        siglongjmp(mmap_fault_env, 1);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void install_sigbus_handler(void) {
+    static int installed = 0;
+    if (!installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_sigbus;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGBUS, &sa, NULL) < 0)
+            log_error("sigaction failed for SIGBUS", 0);
+        installed = 1;
+    }
+}
+
+/*
+ * Write data[start..end) of a mapped window, which lies at file offset off,
+ * unchanged: from the file inside the kernel where possible, otherwise
+ * (or when the output is being hashed or compressed) straight from the mapping.
+ */
+static void emit_mapped_span(int fd, off_t off, const char *data, size_t start, size_t end) {
+    if (start >= end)
+        return;
+#ifdef __linux__
+    off_t pos = off + (off_t)start;
+    if (!out_tap && !out_comp && copy_fd_zerocopy(fd, &pos, (off_t)(end - start)) == 0)
+        return;
+    start = (size_t)(pos - off);
+#else
+    (void)fd; (void)off;
+#endif
+    out_write(data + start, end - start);
+}
+
+/*
+ * Hybrid -v/-T engine for a mapped window. Each HYBRID_BLOCK is scanned;
+ * consecutive clean blocks are emitted together by emit_mapped_span, and only
+ * blocks that contain bytes to expand take the transform path.
+ */
+static void process_mapped_hybrid(int fd, off_t off, const char *data, size_t len, Options *opts) {
+    size_t clean = 0, i = 0;
+    while (i < len) {
+        size_t blk = (len - i < HYBRID_BLOCK) ? len - i : HYBRID_BLOCK;
+        if (span_clean(data + i, blk, opts) < blk) {
+            emit_mapped_span(fd, off, data, clean, i);
+            emit_transformed(data + i, blk, opts);
+            clean = i + blk;
+        }
+        i += blk;
+    }
+    emit_mapped_span(fd, off, data, clean, len);
+}
+
+/* A part of a mapped window counted by a --count thread */
+typedef struct {
+    const char *p;
+    size_t n;
+    Count c;
+    int started, faulted;
+} CountJob;
+
+static void *count_job_run(void *arg) {
+    CountJob *job = arg;
+    if (sigsetjmp(mmap_fault_env, 1)) {
+        job->faulted = 1;
+        return NULL;
+    }
+    mmap_fault_armed = 1;
+    count_block(&job->c, job->p, job->n);
+    mmap_fault_armed = 0;
+    return NULL;
+}
+
+/*
+ * --count for a mapped window: parts of at least COUNT_CHUNK bytes are
+ * counted on one thread per CPU and merged in order. Each thread arms its own
+ * SIGBUS guard; after a fault the parts before it stand as a short read and
+ * -1 is returned. Parts whose thread could not be started are counted here
+ * once the others are done, under the caller's guard.
+ */
+static int count_window(const char *data, size_t len) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t parts = len / COUNT_CHUNK;
+    if (parts > (size_t)(ncpu > 0 ? ncpu : 1)) parts = (size_t)(ncpu > 0 ? ncpu : 1);
+    if (parts > COUNT_THREADS) parts = COUNT_THREADS;
+    if (parts < 2) {
+        count_feed(data, len);
+        return 0;
+    }
+    CountJob job[COUNT_THREADS];
+    pthread_t tid[COUNT_THREADS];
+    size_t step = len / parts;
+    for (size_t i = 0; i < parts; i++) {
+        job[i].p = data + i * step;
+        job[i].n = (i == parts - 1) ? len - i * step : step;
+        job[i].faulted = 0;
+        job[i].started = (pthread_create(&tid[i], NULL, count_job_run, &job[i]) == 0);
+    }
+    for (size_t i = 0; i < parts; i++)
+        if (job[i].started)
+            pthread_join(tid[i], NULL);
+    for (size_t i = 0; i < parts; i++) {
+        if (!job[i].started)
+            count_block(&job[i].c, job[i].p, job[i].n);
+        if (job[i].faulted)
+            return -1;
+        count_merge(&count_file, &job[i].c);
+    }
+    return 0;
+}
+
+/*
+ * Format one mapped window with the SIGBUS guard armed.
+ * Returns the number of bytes consumed, or -1 if the file was truncated
+ * underneath the window (everything emitted so far stands as a short read).
+ */
+/*
+ * The result of process_mapped_window for a window that was read to its end:
+ * -1 if spans into it failed because the file was truncated, which like
+ * EFAULT from write(2) means vanished pages and ends the read early.
+ */
+static long long mapped_window_done(int fd, off_t off, size_t len) {
+    if (out_spans_faulted) {
+        struct stat st;
+        out_spans_faulted = 0;
+        if (fstat(fd, &st) == 0 && st.st_size < off + (off_t)len)
+            return -1;
+        errno = EFAULT;
+        log_error("writev failed", 0);
+    }
+    return (long long)len;
+}
+
+static long long process_mapped_window(int fd, off_t off, const char *data, size_t len,
+                                       int text_mode, TextState *ts) {
+    if (sigsetjmp(mmap_fault_env, 1))
+        return -1;
+    mmap_fault_armed = 1;
+    if (in_tap)
+        digest_update(&in_digest, data, len);
+    if (text_mode && progress.on && !bytewise_only(ts->opts)) {
+        /* Fed in slices so --progress moves while a window is formatted */
+        for (size_t at = 0; at < len; at += PROGRESS_SLICE) {
+            size_t n = len - at < PROGRESS_SLICE ? len - at : PROGRESS_SLICE;
+            text_feed(ts, data + at, n);
+            progress_add(n);
+        }
+        mmap_fault_armed = 0;
+        return mapped_window_done(fd, off, len);
+    }
+    progress_add(len);
+    if (!text_mode && ts->opts->hex) {
+        hex_feed(data, len);
+    } else if (!text_mode && ts->opts->count) {
+        if (count_window(data, len) < 0) {
+            mmap_fault_armed = 0;
+            return -1;
+        }
+    } else if (!text_mode) {
+        if (out_write(data, len) != len) {
+            /* write(2) reports EFAULT rather than SIGBUS for vanished pages */
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size < off + (off_t)len)
+                clearerr(stdout);
+            else
+                log_error("fwrite failed in mmap binary mode", 0);
+        }
+    } else if (bytewise_only(ts->opts) && ts->opts->eol_mode == EOL_KEEP && !ts->opts->max_line &&
+               text_is_plain(ts, data, len)) {
+        process_mapped_hybrid(fd, off, data, len, ts->opts);
+    } else {
+        text_feed(ts, data, len);
+    }
+    mmap_fault_armed = 0;
+    return mapped_window_done(fd, off, len);
+}
+
+/*
+ * Process a regular file from offset off up to end (end < 0: EOF) using
+ * memory mapping on POSIX systems.
+ * The file is mapped one window at a time and re-checked with fstat at every
+ * window boundary, so growth is picked up and truncation ends the read early.
+ * A truncation racing with a window is caught by the SIGBUS guard and also
+ * ends the read cleanly, like a short read() would.
+ * Returns the offset up to which the file was consumed.
+ */
+static off_t process_fd_mmap(int fd, off_t off, off_t end, int text_mode, Options *opts, int *line_no) {
+    install_sigbus_handler();
+    long page = sysconf(_SC_PAGESIZE);
+    TextState ts;
+    text_init(&ts, opts, line_no);
+    for (;;) {
+        struct stat st;
+        if (fstat(fd, &st) < 0) { log_error("fstat failed", 0); break; }
+        off_t stop = (end >= 0 && end < st.st_size) ? end : st.st_size;
+        if (stop <= off) break; /* EOF, or truncated below what was already read */
+        off_t map_off = off - off % page;
+        size_t skip = (size_t)(off - map_off);
+        size_t len = (stop - off < MMAP_WINDOW) ? (size_t)(stop - off) : MMAP_WINDOW;
+        char *map = mmap(NULL, len + skip, PROT_READ, MAP_SHARED, fd, map_off);
+        if (map == MAP_FAILED) { log_error("mmap failed", 0); break; }
+        long long used = process_mapped_window(fd, off, map + skip, len, text_mode, &ts);
+        if (munmap(map, len + skip) < 0)
+            log_error("munmap failed", 0);
+        if (used < 0)
+            break;
+        off += used;
+    }
+    text_finish(&ts);
+    return off;
+}
+
+/*
+ * Pick the fastest engine for one input from its fstat: zero-copy for raw
+ * regular files and pipes, memory mapping for large regular files, and stdio
+ * otherwise. Standard input is handled the same way; a redirected regular
+ * file is read from its current offset, which is then advanced past the data.
+ * A --bytes range seeks regular files and reads past the start of anything else.
+ * Compressed input (see wants_decompress) is routed to the decoders.
+ */
+static void process_input(const char *fname, int use_text, Options *opts, int *line_no) {
+    int is_stdin = !strcmp(fname, "-");
+    int fd = is_stdin ? STDIN_FILENO : open(fname, O_RDONLY);
+    if (fd < 0) { log_error(fname, 0); return; }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        log_error("fstat failed", 0);
+        if (!is_stdin) close(fd);
+        return;
+    }
+    int done = 0, raw = !use_text && !opts->hex && !opts->count && !out_comp, decompress = wants_decompress(opts, use_text);
+    long long limit = (opts->range_end < 0) ? -1 : opts->range_end - opts->range_start;
+    char head[4];
+    size_t head_len = 0;
+    if (S_ISREG(st.st_mode)) {
+        off_t off = is_stdin ? lseek(fd, 0, SEEK_CUR) : 0;
+        if (off < 0) off = 0;
+        off += opts->range_start;
+        off_t begin = off;
+#ifdef CC_HAVE_DECOMPRESS
+        if (decompress) {
+            ssize_t n = pread(fd, head, clamp_read(limit, sizeof(head)), off);
+            int kind = compression_of((const unsigned char *)head, n > 0 ? (size_t)n : 0);
+            if (kind != COMP_NONE) {
+                off = process_compressed_file(fd, kind, off, limit < 0 ? -1 : off + limit, st.st_size,
+                                              use_text, opts, line_no);
+                done = 1;
+            }
+        }
+#endif
+#ifdef __linux__
+        if (!done && raw && copy_fd_digested(fd, &off, limit, st.st_size) == 0)
+            done = 1;
+        if (limit >= 0)
+            limit -= off - begin;
+#endif
+        off_t end = (limit >= 0 && off + limit < st.st_size) ? off + limit : st.st_size;
+        if (!done && end - off >= MMAP_THRESHOLD) {
+            off = process_fd_mmap(fd, off, limit < 0 ? -1 : off + limit, use_text, opts, line_no);
+            done = 1;
+        }
+        if ((is_stdin || !done) && lseek(fd, off, SEEK_SET) < 0)
+            log_error("lseek failed on input", 0);
+    } else if (opts->range_start && skip_input(fd, opts->range_start) < 0) {
+        log_error("Error skipping to --bytes start", 0);
+        done = 1;
+    } else if (decompress) {
+        /* A pipe cannot be peeked; the bytes read here go to whichever engine runs */
+        head_len = read_head(fd, head, clamp_read(limit, sizeof(head)));
+        int kind = compression_of((const unsigned char *)head, head_len);
+#ifdef CC_HAVE_DECOMPRESS
+        if (kind != COMP_NONE) {
+            process_compressed_stream(fd, kind, head, head_len, limit, use_text, opts, line_no);
+            done = 1;
+        }
+#endif
+        if (limit > 0 && kind == COMP_NONE)
+            limit -= (long long)head_len;
+    }
+#ifdef __linux__
+    else if (S_ISFIFO(st.st_mode) && raw && !in_tap && !out_tap) {
+        done = (copy_fd_zerocopy(fd, NULL, limit) == 0);
+    }
+#endif
+    if (!done) {
+        FILE *f = is_stdin ? stdin : fdopen(fd, use_text ? "r" : "rb");
+        if (!f) { log_error(fname, 0); close(fd); return; }
+        if (use_text)
+            process_text(f, head, head_len, opts, line_no, limit);
+        else
+            process_binary(f, head, head_len, opts, limit);
+        if (f != stdin && fclose(f) != 0)
+            log_error("Failed to close input file", 0);
+        return;
+    }
+    if (!is_stdin && close(fd) < 0)
+        log_error("close failed for input file", 0);
+}
+#endif
+
+/*
+ * --merge: one time-ordered stream from inputs that are each in time order.
+ * Inputs are mapped whole (or read, when they are not regular files) and cut
+ * into records: a line with a leading timestamp plus any following lines
+ * without one, such as stack traces. A binary heap picks the input whose
+ * current record is oldest; ties go to the earlier input. Records are written
+ * as spans straight from the mappings, or fed to the text engine when text is
+ * formatted.
+ */
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t pos, end;            /* The current record */
+    long long key, next_key;    /* Its timestamp, and that of the record after it */
+    int index, mapped;
+    char *prefix;               /* --with-filename prefix ("name:") */
+    const char *name;
+} MergeInput;
+
+/* Days from 1970-01-01 to the given civil date (proleptic Gregorian) */
+static long long days_from_civil(long long y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long long)doe - 719468;
+}
+
+static int digits(const char *p, int n, unsigned *v) {
+    *v = 0;
+    for (int i = 0; i < n; i++) {
+        if (p[i] < '0' || p[i] > '9')
+            return 0;
+        *v = *v * 10 + (unsigned)(p[i] - '0');
+    }
+    return 1;
+}
+
+/* Up to nine fraction digits after a '.' or ',' at p, as nanoseconds */
+static long long parse_fraction(const char *p, size_t n) {
+    long long ns = 0, scale = 100000000;
+    if (n < 2 || (p[0] != '.' && p[0] != ',') || p[1] < '0' || p[1] > '9')
+        return 0;
+    for (size_t i = 1; i < n && p[i] >= '0' && p[i] <= '9'; i++, scale /= 10)
+        ns += (p[i] - '0') * scale;
+    return ns;
+}
+
+/*
+ * Parse the timestamp a line starts with (after an optional '[') into
+ * nanoseconds since 1970, ignoring any time zone. MERGE_ISO reads
+ * YYYY-MM-DD[T ]HH:MM:SS[.frac], MERGE_EPOCH seconds[.frac].
+ * Returns 0 if the line does not start with one.
+ */
+static int parse_timestamp(const char *p, size_t n, int format, long long *key) {
+    if (n && p[0] == '[') { p++; n--; }
+    if (format == MERGE_EPOCH) {
+        long long s = 0;
+        size_t i = 0;
+        for (; i < n && i < 12 && p[i] >= '0' && p[i] <= '9'; i++)
+            s = s * 10 + (p[i] - '0');
+        if (!i)
+            return 0;
+        *key = s * 1000000000LL + parse_fraction(p + i, n - i);
+        return 1;
+    }
+    unsigned y, mo, d, h, mi, s;
+    if (n < 19 || p[4] != '-' || p[7] != '-' || (p[10] != 'T' && p[10] != ' ') || p[13] != ':' || p[16] != ':' ||
+        !digits(p, 4, &y) || !digits(p + 5, 2, &mo) || !digits(p + 8, 2, &d) ||
+        !digits(p + 11, 2, &h) || !digits(p + 14, 2, &mi) || !digits(p + 17, 2, &s) ||
+        mo < 1 || mo > 12 || d < 1 || d > 31)
+        return 0;
+    long long secs = days_from_civil(y, mo, d) * 86400 + h * 3600 + mi * 60 + s;
+    *key = secs * 1000000000LL + parse_fraction(p + 19, n - 19);
+    return 1;
+}
+
+/*
+ * Find the end of the record at in->pos: its first line and every line after
+ * it without a timestamp. The timestamp of the line that ends it, if any,
+ * becomes next_key.
+ */
+static void merge_scan(MergeInput *in, int format) {
+    size_t e = in->pos;
+    for (;;) {
+        const char *nl = memchr(in->data + e, '\n', in->len - e);
+        e = nl ? (size_t)(nl - in->data) + 1 : in->len;
+        if (e >= in->len)
+            break;
+        size_t avail = in->len - e;
+        if (parse_timestamp(in->data + e, avail < 64 ? avail : 64, format, &in->next_key))
+            break;
+    }
+    in->end = e;
+}
+
+static int merge_before(const MergeInput *a, const MergeInput *b) {
+    return a->key < b->key || (a->key == b->key && a->index < b->index);
+}
+
+static void heap_sift_down(MergeInput **heap, int n, int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && merge_before(heap[l], heap[m])) m = l;
+        if (r < n && merge_before(heap[r], heap[m])) m = r;
+        if (m == i)
+            return;
+        MergeInput *t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+/*
+ * Load an input for --merge: regular files are mapped, anything else is read
+ * into memory. Returns 0 on success.
+ */
+static int merge_load(MergeInput *in, const char *fname) {
+    int is_stdin = !strcmp(fname, "-");
+#ifdef _WIN32
+    FILE *f = is_stdin ? stdin : fopen(fname, "rb");
+    if (!f) { log_error(fname, 0); return -1; }
+    _setmode(_fileno(f), _O_BINARY);
+#else
+    int fd = is_stdin ? STDIN_FILENO : open(fname, O_RDONLY);
+    if (fd < 0) { log_error(fname, 0); return -1; }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && !is_stdin) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) { log_error("mmap failed", 0); return -1; }
+        in->data = map;
+        in->len = (size_t)st.st_size;
+        in->mapped = 1;
+        return 0;
+    }
+#endif
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    long n;
+    do {
+        if (len + BUFSIZE > cap) {
+            cap = cap ? 2 * cap : 16 * BUFSIZE;
+            char *grown = realloc(buf, cap);
+            if (!grown) log_error("realloc failed for --merge input", 1);
+            buf = grown;
+        }
+#ifdef _WIN32
+        n = read_some(f, buf + len, cap - len);
+#else
+        do {
+            n = (long)read(fd, buf + len, cap - len);
+        } while (n < 0 && errno == EINTR);
+#endif
+        if (n > 0)
+            len += (size_t)n;
+    } while (n > 0);
+    if (n < 0)
+        log_error("Error reading --merge input", 0);
+#ifdef _WIN32
+    if (!is_stdin) fclose(f);
+#else
+    if (!is_stdin) close(fd);
+#endif
+    in->data = buf;
+    in->len = len;
+    return 0;
+}
+
+/* Write one record, adding a newline to an unterminated last line */
+static void merge_emit(MergeInput *in, TextState *ts, int text_mode) {
+    const char *p = in->data + in->pos;
+    size_t n = in->end - in->pos;
+    int add_nl = (p[n - 1] != '\n');
+    progress_add(n);
+    if (text_mode) {
+        if (in->prefix) {
+            line_name = in->name;
+            line_name_len = strlen(in->name);
+            line_prefix = in->prefix;
+            line_prefix_len = line_name_len + 1;
+        }
+        text_feed(ts, p, n);
+        if (add_nl)
+            text_feed(ts, "\n", 1);
+        return;
+    }
+    out_span(p, n);
+    if (add_nl)
+        out_span("\n", 1);
+}
+
+static void process_merge(char **files, int count, int use_text, Options *opts, int *line_no, FILE *digest_out) {
+    MergeInput *in = calloc((size_t)count, sizeof(MergeInput));
+    MergeInput **heap = malloc(sizeof(MergeInput *) * (size_t)count);
+    if (!in || !heap)
+        log_error("malloc failed for --merge", 1);
+    volatile int n = 0, faulted = 0;
+    TextState ts;
+    text_init(&ts, opts, line_no);
+#ifndef _WIN32
+    /* Digests, timestamps and the merge itself all read the mappings */
+    install_sigbus_handler();
+    if (sigsetjmp(mmap_fault_env, 1)) {
+        fprintf(stderr, "cc: --merge: an input was truncated while it was being read\n");
+        out_iovcnt = 0;  /* Pending spans may point into the truncated mapping */
+        faulted = 1;
+    }
+    mmap_fault_armed = 1;
+#endif
+    for (int i = 0; i < count && !faulted; i++) {
+        in[i].index = i;
+        in[i].name = strcmp(files[i], "-") ? files[i] : "(standard input)";
+        if (merge_load(&in[i], files[i]) < 0)
+            continue;
+        if (in_tap) {
+            digest_init(&in_digest, opts->digest);
+            digest_input(in[i].data, in[i].len);
+            digest_report(digest_out, &in_digest, files[i]);
+        }
+        if (opts->with_filename) {
+            if (opts->with_filename == FILENAME_BASE && in[i].name == files[i]) {
+                const char *slash = strrchr(files[i], '/');
+                if (slash) in[i].name = slash + 1;
+            }
+            size_t len = strlen(in[i].name);
+            if (!(in[i].prefix = malloc(len + 1)))
+                log_error("malloc failed for --with-filename", 1);
+            memcpy(in[i].prefix, in[i].name, len);
+            in[i].prefix[len] = ':';
+        }
+        if (!in[i].len)
+            continue;
+        /* Lines before the first timestamp come first */
+        size_t avail = in[i].len < 64 ? in[i].len : 64;
+        if (!parse_timestamp(in[i].data, avail, opts->merge, &in[i].key))
+            in[i].key = -0x7FFFFFFFFFFFFFFFLL - 1;
+        merge_scan(&in[i], opts->merge);
+        heap[n++] = &in[i];
+    }
+    for (int i = n / 2 - 1; i >= 0; i--)
+        heap_sift_down(heap, n, i);
+    while (!faulted && n > 0) {
+        MergeInput *top = heap[0];
+        merge_emit(top, &ts, use_text);
+        top->pos = top->end;
+        if (top->pos < top->len) {
+            top->key = top->next_key;
+            merge_scan(top, opts->merge);
+        } else {
+            heap[0] = heap[--n];
+        }
+        heap_sift_down(heap, n, 0);
+    }
+    if (out_iovcnt)
+        out_spans_flush();
+#ifndef _WIN32
+    mmap_fault_armed = 0;
+#endif
+    text_finish(&ts);
+    if (opts->with_filename)
+        line_prefix = NULL;  /* Owned by the inputs */
+    for (int i = 0; i < count; i++) {
+#ifndef _WIN32
+        if (in[i].mapped) {
+            munmap((void *)in[i].data, in[i].len);
+            in[i].data = NULL;
+        }
+#endif
+        free((void *)in[i].data);
+        free(in[i].prefix);
+    }
+    free(heap);
+    free(in);
+}
+
+/* Global flag for follow mode termination */
+static volatile sig_atomic_t stop_follow = 0;
+
+/*
+ * Signal handler for graceful termination (e.g., on SIGINT).
+ */
+static void handle_sigint(int sig) {
+    (void)sig; /* Unused parameter */
+    stop_follow = 1;
+}
+
+/*
+ * Follow mode processing (tail -f style) for text files.
+ * This loop now checks for SIGINT to allow graceful exit.
+ */
+static void process_follow_text(const char *fname, Options *opts, int *line_no) {
+    FILE *f = fopen(fname, "r");
+    if (!f) { log_error(fname, 0); return; }
+    if (fseek(f, 0, SEEK_END) != 0) { log_error("Initial fseek failed in follow mode", 0); fclose(f); return; }
+    long long current_offset = ftell(f);
+    if (current_offset < 0) { log_error("Initial ftell failed in follow mode", 0); fclose(f); return; }
+
+    /* Register signal handler for graceful termination */
+    #ifndef _WIN32
+    signal(SIGINT, handle_sigint);
+    #endif
+
+    char buf[BUFSIZE];
+    TextState ts;
+    text_init(&ts, opts, line_no);
+    /* The encoding is decided by the start of the file, not of the appended data */
+    if (fseek(f, 0, SEEK_SET) == 0 && read_some(f, buf, 2) == 2) {
+        utf16_decide(&ts, (const unsigned char *)buf);
+        ts.u16_skip = 0;
+    }
+    while (!stop_follow) {
+        struct stat st;
+        if (stat(fname, &st) < 0) {
+            log_error("stat failed in follow mode", 0);
+#ifdef _WIN32
+            Sleep(1000);
+#else
+            sleep(1);
+#endif
+            continue;
+        }
+        if ((long long)st.st_size > current_offset) {
+            /* read_some bypasses stdio, so seek the descriptor itself */
+#ifdef _WIN32
+            if (_lseeki64(_fileno(f), current_offset, SEEK_SET) < 0) {
+#else
+            if (lseek(fileno(f), (off_t)current_offset, SEEK_SET) < 0) {
+#endif
+                log_error("lseek failed in follow mode", 0);
+                break;
+            }
+            long n;
+            while ((n = read_some(f, buf, sizeof(buf))) > 0) {
+                current_offset += n;
+                digest_input(buf, (size_t)n);
+                text_feed(&ts, buf, (size_t)n);
+            }
+            if (n < 0)
+                log_error("Error reading in follow mode", 0);
+            out_flush();
+        }
+#ifdef _WIN32
+        Sleep(1000);
+#else
+        sleep(1);
+#endif
+    }
+    text_finish(&ts);
+    fclose(f);
+}
+
+/*
+ * A file followed by -f --merge. Appended data is buffered until it is
+ * released: in.data is the buffer, in.pos its first unreleased byte and
+ * in.len the end of its complete lines (fill also counts a partial line).
+ * arrive records when each read's data came in, so a record can be timed
+ * against the skew window.
+ */
+typedef struct {
+    MergeInput in;
+    FILE *f;
+    long long offset;
+    size_t fill, cap;
+    int head;                   /* in.pos..in.end is a scanned record */
+    int open;                   /* ...with no record after it yet */
+    struct { size_t end; long long ms; } *arrive;
+    int arrive_n, arrive_cap;
+} FollowInput;
+
+/* Read what has been appended to a followed file, up to its buffer cap */
+static void follow_read(FollowInput *s, long long now) {
+    struct stat st;
+    if (stat(s->in.name, &st) < 0 || (long long)st.st_size <= s->offset)
+        return;
+    if (s->in.pos > 0 && (s->in.pos >= s->fill / 2 || s->fill == s->cap)) {
+        /* Drop released bytes from the front */
+        size_t drop = s->in.pos;
+        memmove((char *)s->in.data, s->in.data + drop, s->fill - drop);
+        s->fill -= drop;
+        s->in.len -= drop;
+        s->in.end = s->head ? s->in.end - drop : 0;
+        s->in.pos = 0;
+        for (int i = 0; i < s->arrive_n; i++)
+            s->arrive[i].end -= drop;
+    }
+#ifdef _WIN32
+    if (_lseeki64(_fileno(s->f), s->offset, SEEK_SET) < 0) {
+#else
+    if (lseek(fileno(s->f), (off_t)s->offset, SEEK_SET) < 0) {
+#endif
+        log_error("lseek failed in follow mode", 0);
+        return;
+    }
+    size_t before = s->fill;
+    long n = 0;
+    while (s->fill < s->cap && (n = read_some(s->f, (char *)s->in.data + s->fill, s->cap - s->fill)) > 0) {
+        s->fill += (size_t)n;
+        s->offset += n;
+    }
+    if (n < 0)
+        log_error("Error reading in follow mode", 0);
+    if (s->fill == before)
+        return;
+    if (s->arrive_n == s->arrive_cap) {
+        s->arrive_cap = s->arrive_cap ? 2 * s->arrive_cap : 16;
+        void *grown = realloc(s->arrive, sizeof(*s->arrive) * (size_t)s->arrive_cap);
+        if (!grown) log_error("realloc failed for -f --merge", 1);
+        s->arrive = grown;
+    }
+    s->arrive[s->arrive_n].end = s->fill;
+    s->arrive[s->arrive_n++].ms = now;
+    size_t e = s->fill;
+    while (e > s->in.len && s->in.data[e - 1] != '\n')
+        e--;
+    /* A line longer than the buffer is cut where the buffer ends */
+    if (e == s->in.pos && s->fill == s->cap)
+        e = s->fill;
+    s->in.len = e;
+    /* An open record may have grown continuation lines or a successor */
+    if (s->open)
+        s->head = 0;
+}
+
+/* Scan the record at in.pos if there is one; returns whether there is */
+static int follow_head(FollowInput *s, int format) {
+    if (s->head)
+        return 1;
+    if (s->in.pos >= s->in.len)
+        return 0;
+    /* Lines without a timestamp keep the key of the record before them */
+    size_t avail = s->in.len - s->in.pos;
+    long long key;
+    if (parse_timestamp(s->in.data + s->in.pos, avail < 64 ? avail : 64, format, &key))
+        s->in.key = key;
+    merge_scan(&s->in, format);
+    s->open = s->in.end >= s->in.len;
+    s->head = 1;
+    return 1;
+}
+
+/* When the data of the record at in.pos came in */
+static long long follow_arrival(FollowInput *s) {
+    int i = 0;
+    while (i < s->arrive_n && s->arrive[i].end <= s->in.pos)
+        i++;
+    if (i) {
+        memmove(s->arrive, s->arrive + i, sizeof(*s->arrive) * (size_t)(s->arrive_n - i));
+        s->arrive_n -= i;
+    }
+    return s->arrive_n ? s->arrive[0].ms : 0;
+}
+
+/*
+ * Release records in timestamp order. The oldest pending record goes out
+ * once every file has a record after it pending (so nothing older can still
+ * come), once it has waited out the skew window (a silent file does not
+ * stall the rest), or when a buffer is full. With drain, everything goes,
+ * partial last lines included.
+ */
+static void follow_release(FollowInput *src, int count, const Options *opts, long long now, TextState *ts, int text_mode, int drain) {
+    for (int i = 0; drain && i < count; i++) {
+        if (src[i].fill > src[i].in.len) {
+            src[i].in.len = src[i].fill;
+            if (src[i].open)
+                src[i].head = 0;
+        }
+    }
+    for (;;) {
+        FollowInput *min = NULL;
+        int all = 1, full = 0;
+        for (int i = 0; i < count; i++) {
+            FollowInput *s = &src[i];
+            if (!follow_head(s, opts->merge)) {
+                all = 0;
+                continue;
+            }
+            if (s->fill == s->cap)
+                full = 1;
+            if (!min || merge_before(&s->in, &min->in))
+                min = s;
+        }
+        if (!min)
+            break;
+        if (!drain && !full && (!all || min->open) && now - follow_arrival(min) < opts->skew_ms)
+            break;
+        merge_emit(&min->in, ts, text_mode);
+        min->in.pos = min->in.end;
+        if (!min->open)
+            min->in.key = min->in.next_key;
+        min->head = 0;
+    }
+    if (out_iovcnt)
+        out_spans_flush();
+}
+
+/*
+ * -f --merge: follow every file from its end and write what is appended to
+ * them in timestamp order, holding records for up to --skew=MS so those
+ * of a file that is a little behind can still be put in place.
+ */
+static void process_follow_merge(char **files, int count, int use_text, Options *opts, int *line_no) {
+    FollowInput *src = calloc((size_t)count, sizeof(FollowInput));
+    if (!src)
+        log_error("malloc failed for -f --merge", 1);
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        FollowInput *s = &src[n];
+        if (!strcmp(files[i], "-")) {
+            fprintf(stderr, "cc: -f --merge cannot follow standard input\n");
+            continue;
+        }
+        if (!(s->f = fopen(files[i], "rb"))) { log_error(files[i], 0); continue; }
+#ifdef _WIN32
+        s->offset = _lseeki64(_fileno(s->f), 0, SEEK_END);
+#else
+        s->offset = (long long)lseek(fileno(s->f), 0, SEEK_END);
+#endif
+        if (s->offset < 0) { log_error("Initial seek failed in follow mode", 0); fclose(s->f); continue; }
+        s->cap = FOLLOW_MERGE_CAP;
+        if (!(s->in.data = malloc(s->cap)))
+            log_error("malloc failed for -f --merge", 1);
+        s->in.index = n;
+        s->in.name = files[i];
+        s->in.key = -0x7FFFFFFFFFFFFFFFLL - 1;
+        if (opts->with_filename) {
+            const char *name = files[i], *slash;
+            if (opts->with_filename == FILENAME_BASE && (slash = strrchr(name, '/')))
+                name = slash + 1;
+            size_t len = strlen(name);
+            if (!(s->in.prefix = malloc(len + 1)))
+                log_error("malloc failed for --with-filename", 1);
+            memcpy(s->in.prefix, name, len);
+            s->in.prefix[len] = ':';
+        }
+        n++;
+    }
+#ifndef _WIN32
+    signal(SIGINT, handle_sigint);
+#endif
+    /* Poll often enough for the window to be kept to within a quarter */
+    long interval = opts->skew_ms / 4;
+    if (interval < 10) interval = 10;
+    if (interval > 1000) interval = 1000;
+    TextState ts;
+    text_init(&ts, opts, line_no);
+    while (!stop_follow && n > 0) {
+        long long now = now_ms();
+        for (int i = 0; i < n; i++)
+            follow_read(&src[i], now);
+        follow_release(src, n, opts, now, &ts, use_text, 0);
+        out_flush();
+        sleep_ms(interval);
+    }
+    follow_release(src, n, opts, now_ms(), &ts, use_text, 1);
+    text_finish(&ts);
+    if (opts->with_filename)
+        line_prefix = NULL;  /* Owned by the inputs */
+    for (int i = 0; i < n; i++) {
+        fclose(src[i].f);
+        free((void *)src[i].in.data);
+        free(src[i].in.prefix);
+        free(src[i].arrive);
+    }
+    free(src);
+}
+
+#ifndef _WIN32
+/*
+ * -f --watch-dir: follow every file in a directory whose name matches
+ * --pattern, including files created later, which are read from their start.
+ * Removed files are read to their end and retired. Files are kept open up to
+ * --max-open; past that, the least recently read is closed and reopened by
+ * name when it grows again. Each file's partial last line is held back so
+ * lines of different files are never joined; like -f --merge, a line longer
+ * than FOLLOW_MERGE_CAP is cut there.
+ */
+typedef struct {
+    char *path;
+    char *name;                 /* Entry name within the directory */
+    char *prefix;               /* --with-filename prefix ("name:") */
+    size_t prefix_len;
+    int fd;                     /* -1 while closed */
+    long long offset;
+    dev_t dev;
+    ino_t ino;
+    unsigned long long used;    /* Clock of the last read, for LRU closing */
+    int seen;                   /* Found by the latest directory scan */
+    char *tail;                 /* Partial last line */
+    size_t tail_len, tail_cap;
+} WatchFile;
+
+static struct {
+    WatchFile *file;
+    int count, cap, open;
+    unsigned long long clock;
+} watched;
+
+static int watch_find(const char *name) {
+    for (int i = 0; i < watched.count; i++)
+        if (!strcmp(watched.file[i].name, name))
+            return i;
+    return -1;
+}
+
+/* Close the least recently read files until another one can be opened */
+static void watch_make_room(int max_open) {
+    while (watched.open >= max_open) {
+        WatchFile *lru = NULL;
+        for (int i = 0; i < watched.count; i++)
+            if (watched.file[i].fd >= 0 && (!lru || watched.file[i].used < lru->used))
+                lru = &watched.file[i];
+        if (!lru)
+            return;
+        close(lru->fd);
+        lru->fd = -1;
+        watched.open--;
+    }
+}
+
+/* Open a watched file if it is closed; a different file under its name is read from the start */
+static int watch_open(WatchFile *w, int max_open) {
+    if (w->fd >= 0)
+        return 0;
+    watch_make_room(max_open);
+    int fd = open(w->path, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_dev != w->dev || st.st_ino != w->ino) {
+        w->dev = st.st_dev;
+        w->ino = st.st_ino;
+        w->offset = 0;
+        w->tail_len = 0;  /* The old file's partial line is gone with it */
+    }
+    w->fd = fd;
+    watched.open++;
+    return 0;
+}
+
+/* Write text of one watched file under its own --with-filename prefix */
+static void watch_emit(WatchFile *w, TextState *ts, const char *p, size_t n) {
+    if (w->prefix) {
+        line_prefix = w->prefix;
+        line_prefix_len = w->prefix_len;
+        line_name = w->prefix;
+        line_name_len = w->prefix_len - 1;
+    }
+    text_feed(ts, p, n);
+}
+
+/* Write what has been appended to a watched file, holding back a partial last line */
+static void watch_read(WatchFile *w, TextState *ts, int max_open) {
+    if (watch_open(w, max_open) < 0)
+        return;
+    w->used = ++watched.clock;
+    struct stat st;
+    if (fstat(w->fd, &st) == 0 && (long long)st.st_size < w->offset) {
+        fprintf(stderr, "cc: %s: file truncated\n", w->path);
+        w->offset = 0;
+        w->tail_len = 0;
+    }
+    char buf[BUFSIZE];
+    ssize_t n;
+    for (;;) {
+        do {
+            n = pread(w->fd, buf, sizeof(buf), (off_t)w->offset);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            break;
+        w->offset += n;
+        progress_add((size_t)n);
+        size_t keep = (size_t)n;
+        while (keep > 0 && buf[keep - 1] != '\n')
+            keep--;
+        if (keep) {
+            if (w->tail_len)
+                watch_emit(w, ts, w->tail, w->tail_len);
+            watch_emit(w, ts, buf, keep);
+            w->tail_len = 0;
+        }
+        if (keep < (size_t)n) {
+            size_t rest = (size_t)n - keep;
+            if (w->tail_len + rest > w->tail_cap) {
+                w->tail_cap = (w->tail_len + rest) * 2;
+                if (w->tail_cap > FOLLOW_MERGE_CAP)
+                    w->tail_cap = FOLLOW_MERGE_CAP;
+                char *grown = realloc(w->tail, w->tail_cap);
+                if (!grown) log_error("realloc failed for --watch-dir", 1);
+                w->tail = grown;
+            }
+            if (w->tail_len + rest > FOLLOW_MERGE_CAP) {
+                /* A line longer than the cap is cut where the cap ends */
+                size_t fit = FOLLOW_MERGE_CAP - w->tail_len;
+                memcpy(w->tail + w->tail_len, buf + keep, fit);
+                watch_emit(w, ts, w->tail, FOLLOW_MERGE_CAP);
+                watch_emit(w, ts, "\n", 1);
+                w->tail_len = 0;
+                keep += fit;
+                rest -= fit;
+            }
+            memcpy(w->tail + w->tail_len, buf + keep, rest);
+            w->tail_len += rest;
+        }
+    }
+    if (n < 0)
+        log_error(w->path, 0);
+}
+
+/* Start watching a directory entry, from its end if it existed before cc started */
+static WatchFile *watch_add(const char *dir, const char *name, int from_end, const Options *opts) {
+    if (watched.count == watched.cap) {
+        watched.cap = watched.cap ? 2 * watched.cap : 16;
+        void *grown = realloc(watched.file, sizeof(WatchFile) * (size_t)watched.cap);
+        if (!grown) log_error("realloc failed for --watch-dir", 1);
+        watched.file = grown;
+    }
+    WatchFile *w = &watched.file[watched.count];
+    memset(w, 0, sizeof(*w));
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    if (!(w->path = malloc(dlen + nlen + 2)) || !(w->name = malloc(nlen + 1)))
+        log_error("malloc failed for --watch-dir", 1);
+    memcpy(w->path, dir, dlen);
+    w->path[dlen] = '/';
+    memcpy(w->path + dlen + 1, name, nlen + 1);
+    memcpy(w->name, name, nlen + 1);
+    w->fd = -1;
+    w->seen = 1;
+    if (watch_open(w, opts->max_open) < 0) {
+        free(w->path);
+        free(w->name);
+        return NULL;
+    }
+    if (from_end) {
+        struct stat st;
+        if (fstat(w->fd, &st) == 0)
+            w->offset = (long long)st.st_size;
+    }
+    if (opts->with_filename) {
+        const char *shown = opts->with_filename == FILENAME_BASE ? w->name : w->path;
+        w->prefix_len = strlen(shown) + 1;
+        if (!(w->prefix = malloc(w->prefix_len)))
+            log_error("malloc failed for --with-filename", 1);
+        memcpy(w->prefix, shown, w->prefix_len - 1);
+        w->prefix[w->prefix_len - 1] = ':';
+    }
+    watched.count++;
+    return w;
+}
+
+/* Read a watched file to its end and stop watching it */
+static void watch_retire(int i, TextState *ts, int max_open) {
+    WatchFile *w = &watched.file[i];
+    if (w->fd >= 0)
+        watch_read(w, ts, max_open);  /* An open file can still be read after it is removed */
+    if (w->tail_len) {
+        watch_emit(w, ts, w->tail, w->tail_len);
+        watch_emit(w, ts, "\n", 1);
+    }
+    if (w->fd >= 0) {
+        close(w->fd);
+        watched.open--;
+    }
+    free(w->path);
+    free(w->name);
+    free(w->prefix);
+    free(w->tail);
+    watched.file[i] = watched.file[--watched.count];
+}
+
+/*
+ * Scan the directory: new matching entries are added (from their end on the
+ * first scan, from their start after that) and read. With retire, files that
+ * are gone are retired.
+ */
+static void watch_scan(const char *dir, const Options *opts, TextState *ts, int first, int retire) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        log_error(dir, first);
+        return;
+    }
+    for (int i = 0; i < watched.count; i++)
+        watched.file[i].seen = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.' && (!e->d_name[1] || (e->d_name[1] == '.' && !e->d_name[2])))
+            continue;
+        if (fnmatch(opts->watch_pattern, e->d_name, 0) != 0)
+            continue;
+        int i = watch_find(e->d_name);
+        if (i >= 0)
+            watched.file[i].seen = 1;
+        else
+            watch_add(dir, e->d_name, first, opts);
+    }
+    closedir(d);
+    for (int i = watched.count - 1; i >= 0; i--) {
+        if (retire && !watched.file[i].seen)
+            watch_retire(i, ts, opts->max_open);
+        else if (!first)
+            watch_read(&watched.file[i], ts, opts->max_open);
+    }
+}
+
+static void process_watch_dir(Options *opts, int *line_no) {
+    const char *dir = opts->watch_dir;
+    TextState ts;
+    text_init(&ts, opts, line_no);
+    signal(SIGINT, handle_sigint);
+    watch_scan(dir, opts, &ts, 1, 0);
+    int ifd = -1;
+#ifdef __linux__
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd >= 0 && inotify_add_watch(ifd, dir, IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_DELETE |
+                                      IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        log_error(dir, 0);
+        close(ifd);
+        ifd = -1;
+    }
+    char events[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (ifd >= 0 && !stop_follow) {
+        struct pollfd p = { .fd = ifd, .events = POLLIN };
+        if (poll(&p, 1, 1000) <= 0)
+            continue;
+        ssize_t len = read(ifd, events, sizeof(events));
+        if (len <= 0)
+            continue;
+        int rescan = 0, gone = 0;
+        for (char *at = events; at < events + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)at;
+            at += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW)
+                rescan = 1;
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+                gone = 1;
+            if (!ev->len || fnmatch(opts->watch_pattern, ev->name, 0) != 0)
+                continue;
+            int i = watch_find(ev->name);
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (i >= 0)
+                    watch_retire(i, &ts, opts->max_open);
+                continue;
+            }
+            if (i >= 0 && (ev->mask & IN_MOVED_TO)) {
+                /* Another file was renamed over this one */
+                watch_retire(i, &ts, opts->max_open);
+                i = -1;
+            }
+            WatchFile *w = i >= 0 ? &watched.file[i] : watch_add(dir, ev->name, 0, opts);
+            if (w)
+                watch_read(w, &ts, opts->max_open);
+        }
+        if (rescan)
+            watch_scan(dir, opts, &ts, 0, 1);
+        out_flush();
+        if (gone) {
+            fprintf(stderr, "cc: %s: directory removed\n", dir);
+            break;
+        }
+    }
+#endif
+    while (ifd < 0 && !stop_follow) {
+        /* Without inotify, the directory is scanned every second */
+        watch_scan(dir, opts, &ts, 0, 1);
+        out_flush();
+        sleep(1);
+    }
+    if (ifd >= 0)
+        close(ifd);
+    while (watched.count > 0)
+        watch_retire(watched.count - 1, &ts, opts->max_open);
+    text_finish(&ts);
+    if (opts->with_filename)
+        line_prefix = NULL;  /* Owned by the watched files */
+    free(watched.file);
+}
+#endif
+
+/*
+ * Parse a non-negative decimal option value; exits on malformed input.
+ */
+static int parse_count(const char *s, const char *opt) {
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (!*s || *end || v < 0 || v > 0x7FFFFFFF || errno) {
+        fprintf(stderr, "Invalid value for %s: %s\n", opt, s);
+        exit(EXIT_FAILURE);
+    }
+    return (int)v;
+}
+
+/*
+ * Parse a byte count with an optional K, M or G (binary) suffix; exits on
+ * malformed input.
+ */
+static long long parse_size(const char *s, const char *opt) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    int shift = 0;
+    if (*end == 'K') shift = 10;
+    else if (*end == 'M') shift = 20;
+    else if (*end == 'G') shift = 30;
+    if (shift) end++;
+    if (!*s || *s == '-' || *end || v < 0 || errno || v > (0x7FFFFFFFFFFFFFFFLL >> shift)) {
+        fprintf(stderr, "Invalid value for %s: %s\n", opt, s);
+        exit(EXIT_FAILURE);
+    }
+    return v << shift;
+}
+
+/*
+ * Parse --max-line=N[c][,truncate|wrap][,marker]: N bytes (K, M and G
+ * suffixes allowed) or, with c, N UTF-8 characters. Exits on malformed input.
+ */
+static void parse_max_line(const char *s, Options *opts) {
+    char num[32];
+    size_t len = strcspn(s, ",");
+    if (len == 0 || len >= sizeof(num)) {
+        fprintf(stderr, "Invalid value for --max-line: %s\n", s);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(num, s, len);
+    num[len] = '\0';
+    opts->max_line_chars = (num[len - 1] == 'c');
+    if (opts->max_line_chars)
+        num[len - 1] = '\0';
+    opts->max_line = parse_size(num, "--max-line");
+    if (opts->max_line < 1) {
+        fprintf(stderr, "Invalid value for --max-line: %s\n", s);
+        exit(EXIT_FAILURE);
+    }
+    for (s += len; *s == ','; s += len) {
+        s++;
+        len = strcspn(s, ",");
+        if (len == 8 && !strncmp(s, "truncate", 8))
+            opts->max_line_wrap = 0;
+        else if (len == 4 && !strncmp(s, "wrap", 4))
+            opts->max_line_wrap = 1;
+        else if (len == 6 && !strncmp(s, "marker", 6))
+            opts->max_line_marker = 1;
+        else {
+            fprintf(stderr, "Invalid value for --max-line: %.*s (use truncate, wrap or marker)\n", (int)len, s);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Parse a --bytes=START-END range; either bound may be left out.
+ */
+static void parse_range(const char *s, Options *opts) {
+    const char *dash = strchr(s, '-');
+    if (!dash) {
+        fprintf(stderr, "Invalid value for --bytes: %s (expected START-END)\n", s);
+        exit(EXIT_FAILURE);
+    }
+    char start[32];
+    size_t n = (size_t)(dash - s);
+    if (n >= sizeof(start)) n = sizeof(start) - 1;
+    memcpy(start, s, n);
+    start[n] = '\0';
+    opts->range_start = n ? parse_size(start, "--bytes") : 0;
+    opts->range_end = dash[1] ? parse_size(dash + 1, "--bytes") : -1;
+    if (opts->range_end >= 0 && opts->range_end < opts->range_start) {
+        fprintf(stderr, "Invalid value for --bytes: %s (END is before START)\n", s);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Parse --sample=1/N (N >= 1); exits on malformed input.
+ */
+static long long parse_every(const char *s) {
+    if (strncmp(s, "1/", 2) != 0) {
+        fprintf(stderr, "Invalid value for --sample: %s (expected 1/N)\n", s);
+        exit(EXIT_FAILURE);
+    }
+    long long n = parse_size(s + 2, "--sample");
+    if (n < 1) {
+        fprintf(stderr, "Invalid value for --sample: %s (N must be at least 1)\n", s);
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
+/*
+ * Parse a --sample-rate probability between 0 and 1; exits on malformed input.
+ */
+static double parse_rate(const char *s) {
+    char *end;
+    errno = 0;
+    double p = strtod(s, &end);
+    if (!*s || *end || errno || !(p >= 0 && p <= 1)) {
+        fprintf(stderr, "Invalid value for --sample-rate: %s (expected 0 to 1)\n", s);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/*
+ * Check a --match/--exclude string: lines are searched one at a time, so it
+ * can be neither empty nor span a newline. Exits on bad input.
+ */
+static const char *parse_pattern(const char *s, const char *opt) {
+    if (!*s || strchr(s, '\n')) {
+        fprintf(stderr, "Invalid value for %s: the string must be non-empty and on one line\n", opt);
+        exit(EXIT_FAILURE);
+    }
+    return s;
+}
+
+/*
+ * Parse command-line flags and collect file names.
+ * Exits immediately on allocation or parsing errors.
+ */
+static int parse_global_flags(int argc, char *argv[], Options *opts, char ***file_list) {
+    int fileCount = 0, parsing_flags = 1;
+    char **files = malloc(sizeof(char*) * argc);
+    if (!files) { log_error("malloc failed in parse_global_flags", 1); }
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (parsing_flags && strcmp(arg, "--") == 0) { parsing_flags = 0; continue; }
+        if (parsing_flags && arg[0] == '-' && arg[1]) {
+            if (arg[0] == '-' && arg[1] == '-') {
+                if (!strcmp(arg, "--help")) { usage(); exit(EXIT_SUCCESS); }
+                else if (!strcmp(arg, "--version")) { version(); exit(EXIT_SUCCESS); }
+                else if (!strcmp(arg, "--unix-eol")) opts->eol_mode = EOL_UNIX;
+                else if (!strcmp(arg, "--dos-eol")) opts->eol_mode = EOL_DOS;
+                else if (!strcmp(arg, "--from-utf16")) opts->from_utf16 = UTF16_BOM;
+                else if (!strcmp(arg, "--from-utf16=le")) opts->from_utf16 = UTF16_LE;
+                else if (!strcmp(arg, "--from-utf16=be")) opts->from_utf16 = UTF16_BE;
+                else if (!strcmp(arg, "--json-lines")) opts->json_lines = JSON_STRING;
+                else if (!strcmp(arg, "--json-lines=object")) opts->json_lines = JSON_OBJECT;
+                else if (!strcmp(arg, "--hex")) opts->hex = 1;
+                else if (!strcmp(arg, "--count")) opts->count = 1;
+                else if (!strncmp(arg, "--bytes=", 8)) parse_range(arg + 8, opts);
+                else if (!strcmp(arg, "--digest=crc32c")) opts->digest = DIGEST_CRC32C;
+                else if (!strcmp(arg, "--digest=xxh3")) opts->digest = DIGEST_XXH3;
+                else if (!strcmp(arg, "--digest=sha256")) opts->digest = DIGEST_SHA256;
+                else if (!strcmp(arg, "--digest-of=input")) opts->digest_of = DIGEST_INPUT;
+                else if (!strcmp(arg, "--digest-of=output")) opts->digest_of = DIGEST_OUTPUT;
+                else if (!strcmp(arg, "--digest-of=both")) opts->digest_of = DIGEST_INPUT | DIGEST_OUTPUT;
+                else if (!strncmp(arg, "--digest-file=", 14) && arg[14]) opts->digest_file = arg + 14;
+                else if (!strcmp(arg, "--decompress")) opts->decompress = DECOMP_ALWAYS;
+                else if (!strcmp(arg, "--no-decompress")) opts->decompress = DECOMP_NEVER;
+                else if (!strcmp(arg, "--compress=gzip")) opts->compress = COMP_GZIP;
+                else if (!strcmp(arg, "--compress=zstd")) opts->compress = COMP_ZSTD;
+                else if (!strncmp(arg, "--match=", 8)) opts->match = parse_pattern(arg + 8, "--match");
+                else if (!strcmp(arg, "--match") && i + 1 < argc) opts->match = parse_pattern(argv[++i], "--match");
+                else if (!strncmp(arg, "--exclude=", 10)) opts->exclude = parse_pattern(arg + 10, "--exclude");
+                else if (!strcmp(arg, "--exclude") && i + 1 < argc) opts->exclude = parse_pattern(argv[++i], "--exclude");
+                else if (!strcmp(arg, "--filter-after")) opts->filter_after = 1;
+                else if (!strcmp(arg, "--with-filename")) opts->with_filename = FILENAME_PATH;
+                else if (!strcmp(arg, "--uniq")) opts->uniq = 1;
+                else if (!strcmp(arg, "--uniq=count")) opts->uniq = opts->uniq_count = 1;
+                else if (!strcmp(arg, "--dedupe")) opts->dedupe = 1;
+                else if (!strcmp(arg, "--merge") || !strcmp(arg, "--merge=iso")) opts->merge = MERGE_ISO;
+                else if (!strcmp(arg, "--merge=epoch")) opts->merge = MERGE_EPOCH;
+                else if (!strncmp(arg, "--skew=", 7)) opts->skew_ms = parse_count(arg + 7, "--skew");
+                else if (!strncmp(arg, "--watch-dir=", 12)) opts->watch_dir = arg + 12;
+                else if (!strcmp(arg, "--watch-dir") && i + 1 < argc) opts->watch_dir = argv[++i];
+                else if (!strncmp(arg, "--pattern=", 10)) opts->watch_pattern = arg + 10;
+                else if (!strcmp(arg, "--pattern") && i + 1 < argc) opts->watch_pattern = argv[++i];
+                else if (!strcmp(arg, "--progress")) opts->progress = 1;
+                else if (!strcmp(arg, "--auto") || !strcmp(arg, "--auto=raw")) opts->auto_mode = AUTO_RAW;
+                else if (!strcmp(arg, "--auto=hex")) opts->auto_mode = AUTO_HEX;
+                else if (!strncmp(arg, "--tee=", 6) || (!strcmp(arg, "--tee") && i + 1 < argc)) {
+                    if (opts->tee_count == TEE_MAX) {
+                        fprintf(stderr, "At most %d --tee outputs are supported\n", TEE_MAX);
+                        exit(EXIT_FAILURE);
+                    }
+                    opts->tee_path[opts->tee_count++] = arg[5] == '=' ? arg + 6 : argv[++i];
+                }
+                else if (!strcmp(arg, "--tee-policy=block")) opts->tee_policy = TEE_BLOCK;
+                else if (!strcmp(arg, "--tee-policy=drop")) opts->tee_policy = TEE_DROP;
+                else if (!strcmp(arg, "--framed") || !strcmp(arg, "--framed=varint")) opts->framed = FRAME_VARINT;
+                else if (!strcmp(arg, "--framed=u32")) opts->framed = FRAME_U32;
+                else if (!strcmp(arg, "--frame-seq")) opts->frame_seq = 1;
+                else if (!strncmp(arg, "--max-line=", 11)) parse_max_line(arg + 11, opts);
+                else if (!strncmp(arg, "--max-open=", 11)) opts->max_open = parse_count(arg + 11, "--max-open");
+                else if (!strncmp(arg, "--dedupe-memory=", 16)) opts->dedupe_memory = parse_size(arg + 16, "--dedupe-memory");
+                else if (!strcmp(arg, "--with-filename=basename")) opts->with_filename = FILENAME_BASE;
+                else if (!strncmp(arg, "--sample=", 9)) opts->sample_every = parse_every(arg + 9);
+                else if (!strcmp(arg, "--sample") && i + 1 < argc) opts->sample_every = parse_every(argv[++i]);
+                else if (!strncmp(arg, "--sample-rate=", 14)) opts->sample_rate = parse_rate(arg + 14);
+                else if (!strcmp(arg, "--sample-rate") && i + 1 < argc) opts->sample_rate = parse_rate(argv[++i]);
+                else if (!strncmp(arg, "--seed=", 7)) opts->seed = parse_size(arg + 7, "--seed");
+                else if (!strcmp(arg, "--seed") && i + 1 < argc) opts->seed = parse_size(argv[++i], "--seed");
+                else if (!strncmp(arg, "--squeeze-limit=", 16)) {
+                    opts->squeeze_limit = parse_count(arg + 16, "--squeeze-limit");
+                    opts->flag_squeeze = 1;
+                }
+                else { fprintf(stderr, "Unknown option: %s\n", arg); exit(EXIT_FAILURE); }
+            } else {
+                for (int j = 1; arg[j]; j++) {
+                    switch(arg[j]) {
+                        case 'n': opts->flag_num = 1; break;
+                        case 'b': opts->flag_nnb = 1; break;
+                        case 's': opts->flag_squeeze = 1; break;
+                        case 'e': opts->flag_ends = 1; break;
+                        case 'T': opts->flag_tabs = 1; break;
+                        case 'v': opts->flag_nonprinting = 1; break;
+                        case 'A': opts->flag_nonprinting = opts->flag_tabs = opts->flag_ends = 1; break;
+                        case 'f': opts->flag_follow = 1; break;
+                        case 'h': usage(); exit(EXIT_SUCCESS);
+                        case 'V': version(); exit(EXIT_SUCCESS);
+                        default:
+                            fprintf(stderr, "Unknown flag: -%c\n", arg[j]);
+                            exit(EXIT_FAILURE);
+                    }
+                }
+            }
+        } else {
+            files[fileCount++] = arg;
+        }
+    }
+    if (fileCount == 0)
+        files[fileCount++] = "-";
+    opts->match_len = opts->match ? strlen(opts->match) : 0;
+    opts->exclude_len = opts->exclude ? strlen(opts->exclude) : 0;
+    *file_list = files;
+    return fileCount;
+}
+
+/*
+ * --auto: sample the start of a regular file to decide whether it is binary.
+ * Pipes cannot be sampled without consuming them, so they count as text, as
+ * do compressed files that are about to be decompressed.
+ */
+static int auto_is_binary(const char *fname, const Options *opts, int use_text) {
+    unsigned char buf[AUTO_SAMPLE];
+    int is_stdin = !strcmp(fname, "-");
+    long long n = -1;
+#ifdef _WIN32
+    int fd = is_stdin ? _fileno(stdin) : _open(fname, _O_RDONLY | _O_BINARY);
+    struct _stati64 st;
+    if (fd < 0)
+        return 0;
+    if (_fstati64(fd, &st) == 0 && (st.st_mode & _S_IFREG)) {
+        long long at = _lseeki64(fd, 0, SEEK_CUR);
+        if (_lseeki64(fd, (is_stdin ? at : 0) + opts->range_start, SEEK_SET) >= 0)
+            n = _read(fd, buf, sizeof(buf));
+        _lseeki64(fd, at, SEEK_SET);
+    }
+    if (!is_stdin)
+        _close(fd);
+#else
+    int fd = is_stdin ? STDIN_FILENO : open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t at = is_stdin ? lseek(fd, 0, SEEK_CUR) : 0;
+        n = pread(fd, buf, sizeof(buf), (at < 0 ? 0 : at) + opts->range_start);
+    }
+    if (!is_stdin)
+        close(fd);
+#endif
+    if (n <= 0)
+        return 0;
+    if (opts->range_end >= 0 && opts->range_end - opts->range_start < n)
+        n = opts->range_end - opts->range_start;
+#ifdef CC_HAVE_DECOMPRESS
+    if (wants_decompress(opts, use_text) && compression_of(buf, (size_t)n) != COMP_NONE)
+        return 0;
+#else
+    (void)use_text;
+#endif
+    return looks_binary(buf, (size_t)n);
+}
+
+/*
+ * Set the --with-filename name and line prefix for the input fname. Standard
+ * input is named as grep names it.
+ */
+static void set_line_name(const char *fname, int mode) {
+    const char *name = strcmp(fname, "-") ? fname : "(standard input)";
+    if (mode == FILENAME_BASE && name == fname) {
+        for (const char *p = fname; *p; p++)
+#ifdef _WIN32
+            if (*p == '/' || *p == '\\')
+#else
+            if (*p == '/')
+#endif
+                name = p + 1;
+    }
+    line_name = name;
+    line_name_len = strlen(name);
+    free(line_prefix);
+    if (!(line_prefix = malloc(line_name_len + 1)))
+        log_error("malloc failed for --with-filename", 1);
+    memcpy(line_prefix, name, line_name_len);
+    line_prefix[line_name_len] = ':';
+    line_prefix_len = line_name_len + 1;
+}
+
+/*
+ * Main entry point.
+ * Determines processing mode (text, binary or follow) and hands each file to process_input,
+ * which picks the engine.
+ * If no file is specified and STDIN is interactive, usage is printed to avoid hanging.
+ */
+int main(int argc, char *argv[]) {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+    // _setmode(_fileno(stdout), _O_BINARY); // Uncomment if binary output is needed
+#endif
+    setvbuf(stdout, NULL, _IOFBF, BUFSIZE);
+    Options opts = global_defaults;
+    char **files;
+    int fileCount = parse_global_flags(argc, argv, &opts, &files);
+
+    /* If running interactively with no file redirection, show usage instead of hanging */
+    if (fileCount == 1 && strcmp(files[0], "-") == 0 && !opts.watch_dir) {
+#ifdef _WIN32
+        if (_isatty(_fileno(stdin))) { usage(); free(files); return EXIT_SUCCESS; }
+#else
+        if (isatty(fileno(stdin))) { usage(); free(files); return EXIT_SUCCESS; }
+#endif
+    }
+
+    if ((opts.digest_file || opts.digest_of != DIGEST_INPUT) && !opts.digest) {
+        fprintf(stderr, "--digest-of and --digest-file need --digest\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+#ifndef CC_HAVE_DECOMPRESS
+    if (opts.decompress == DECOMP_ALWAYS) {
+        fprintf(stderr, "--decompress: cc was built without zlib or zstd support\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+#endif
+#ifndef CC_HAVE_ZLIB
+    if (opts.compress == COMP_GZIP) {
+        fprintf(stderr, "--compress=gzip: cc was built without zlib support\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+#endif
+#ifndef CC_HAVE_ZSTD
+    if (opts.compress == COMP_ZSTD) {
+        fprintf(stderr, "--compress=zstd: cc was built without zstd support\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+#endif
+    if (opts.flag_follow && (opts.hex || opts.count || opts.range_start || opts.range_end >= 0)) {
+        fprintf(stderr, "--hex, --count and --bytes cannot be used with -f\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.sample_every && opts.sample_rate >= 0) {
+        fprintf(stderr, "--sample and --sample-rate cannot be used together\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.sample_rate >= 0) {
+        sample_state = (uint64_t)((opts.seed >= 0) ? opts.seed : ((long long)time(NULL) << 20 ^ (long long)clock()));
+        sample_state = (sample_state ^ 0x9E3779B97F4A7C15ULL) * 0xBF58476D1CE4E5B9ULL;
+        if (!sample_state)
+            sample_state = 0x9E3779B97F4A7C15ULL;
+    }
+    if (opts.with_filename && (opts.hex || opts.count || opts.json_lines == JSON_STRING)) {
+        fprintf(stderr, "--with-filename cannot be used with --hex, --count or --json-lines (use --json-lines=object)\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.merge && (opts.hex || opts.count || opts.range_start || opts.range_end >= 0)) {
+        fprintf(stderr, "--merge cannot be used with --hex, --count or --bytes\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.merge && opts.flag_follow && opts.digest && (opts.digest_of & DIGEST_INPUT)) {
+        fprintf(stderr, "-f --merge cannot digest its inputs (use --digest-of=output)\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.watch_dir) {
+        const char *why = NULL;
+#ifdef _WIN32
+        why = "--watch-dir is not supported on Windows";
+#endif
+        if (!opts.flag_follow)
+            why = "--watch-dir needs -f";
+        else if (fileCount != 1 || strcmp(files[0], "-") != 0)
+            why = "--watch-dir cannot be used with FILE arguments";
+        else if (opts.merge)
+            why = "--watch-dir cannot be used with --merge";
+        else if (opts.digest && (opts.digest_of & DIGEST_INPUT))
+            why = "--watch-dir cannot digest its inputs (use --digest-of=output)";
+        else if (opts.max_open < 1)
+            why = "Invalid value for --max-open: at least 1 is needed";
+        if (why) {
+            fprintf(stderr, "%s\n", why);
+            free(files);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opts.auto_mode && (opts.flag_follow || opts.merge || opts.hex || opts.count || opts.json_lines)) {
+        fprintf(stderr, "--auto cannot be used with -f, --merge, --hex, --count or --json-lines\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.framed && (opts.flag_num || opts.flag_nnb || opts.flag_ends || opts.flag_tabs || opts.flag_nonprinting ||
+                        opts.eol_mode == EOL_DOS || opts.json_lines || opts.with_filename || opts.uniq_count ||
+                        opts.hex || opts.count || opts.auto_mode)) {
+        fprintf(stderr, "--framed writes lines as they are: it cannot be used with -n, -b, -e, -T, -v, --dos-eol,\n"
+                        "--json-lines, --with-filename, --uniq=count, --hex, --count or --auto (use --frame-seq for numbers)\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.max_line && (opts.hex || opts.count || (opts.max_line_wrap && opts.max_line_marker))) {
+        fprintf(stderr, "--max-line cannot be used with --hex or --count, and wrap has no marker\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.frame_seq && !opts.framed) {
+        fprintf(stderr, "--frame-seq needs --framed\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.uniq && opts.dedupe) {
+        fprintf(stderr, "--uniq and --dedupe cannot be used together\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.uniq_count && opts.json_lines) {
+        fprintf(stderr, "--uniq=count cannot be used with --json-lines\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.dedupe_memory < 65536) {
+        fprintf(stderr, "Invalid value for --dedupe-memory: at least 64K is needed\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.hex && opts.count) {
+        fprintf(stderr, "--hex and --count cannot be used together\n");
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (opts.flag_nonprinting)
+        init_vis_table();
+    if (opts.hex)
+        init_hex((unsigned long long)opts.range_start);
+    FILE *digest_out = stderr;
+    if (opts.digest) {
+        if (opts.digest_file && !(digest_out = fopen(opts.digest_file, "w")))
+            log_error(opts.digest_file, 1);
+        in_tap = (opts.digest_of & DIGEST_INPUT) != 0;
+        out_tap = (opts.digest_of & DIGEST_OUTPUT) != 0;
+        digest_init(&out_digest, opts.digest);
+    }
+#ifdef CC_HAVE_COMPRESS
+    if (opts.compress) {
+#ifdef _WIN32
+        if (_isatty(_fileno(stdout))) {
+#else
+        if (isatty(fileno(stdout))) {
+#endif
+            fprintf(stderr, "--compress: refusing to write compressed data to a terminal\n");
+            free(files);
+            return EXIT_FAILURE;
+        }
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        comp_start(opts.compress);
+    }
+#endif
+#ifdef _WIN32
+    if (opts.framed)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    for (int i = 0; i < opts.tee_count; i++) {
+#ifdef _WIN32
+        int fd = _open(opts.tee_path[i], _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        int fd = open(opts.tee_path[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd >= 0 && opts.tee_policy == TEE_DROP)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+        if (fd < 0)
+            log_error(opts.tee_path[i], 1);
+        tee_out.path[tee_out.count] = opts.tee_path[i];
+        tee_out.fd[tee_out.count++] = fd;
+    }
+    tee_out.policy = opts.tee_policy;
+    if (tee_out.count) {
+        fflush(stdout);  /* Output bypasses stdio from here on */
+#ifndef _WIN32
+        signal(SIGPIPE, SIG_IGN);  /* A tee's reader going away is not fatal */
+#endif
+    }
+    /* --hex dumps and --count counts the raw bytes; both ignore the formatting options */
+    int use_text = !opts.hex && !opts.count && (opts.flag_num || opts.flag_nnb || opts.flag_squeeze ||
+                    opts.flag_ends || opts.flag_tabs || opts.flag_nonprinting ||
+                    opts.eol_mode != EOL_KEEP || opts.from_utf16 != UTF16_AUTO || opts.json_lines ||
+                    opts.match || opts.exclude || opts.sample_every || opts.sample_rate >= 0 ||
+                    opts.with_filename || opts.uniq || opts.dedupe || opts.framed || opts.max_line);
+    int line_no = 1;
+    if (opts.progress)
+        progress_start(opts.flag_follow ? 0 : progress_total(files, fileCount, &opts));
+#ifndef _WIN32
+    if (opts.watch_dir)
+        process_watch_dir(&opts, &line_no);
+    else
+#endif
+    if (opts.merge && opts.flag_follow)
+        process_follow_merge(files, fileCount, use_text, &opts, &line_no);
+    else if (opts.merge)
+        process_merge(files, fileCount, use_text, &opts, &line_no, digest_out);
+    for (int i = 0; i < fileCount && !opts.merge && !opts.watch_dir; i++) {
+        const char *fname = files[i];
+        if (in_tap)
+            digest_init(&in_digest, opts.digest);
+        memset(&count_file, 0, sizeof(count_file));
+        if (opts.with_filename)
+            set_line_name(fname, opts.with_filename);
+        if (opts.flag_follow && strcmp(fname, "-") != 0) {
+            process_follow_text(fname, &opts, &line_no);
+        } else if (opts.auto_mode && auto_is_binary(fname, &opts, use_text)) {
+            /* Binary inputs skip the text engine: copied as they are, or dumped in hex */
+            Options binary = opts;
+            binary.hex = (opts.auto_mode == AUTO_HEX);
+            if (binary.hex) {
+                memset(&hex, 0, sizeof(hex));
+                init_hex((unsigned long long)opts.range_start);
+            }
+            process_input(fname, 0, &binary, &line_no);
+            if (binary.hex)
+                hex_finish();
+        } else {
+            process_input(fname, use_text, &opts, &line_no);
+        }
+        if (opts.count)
+            count_report(&count_file, fname);
+        if (in_tap)
+            digest_report(digest_out, &in_digest, fname);
+    }
+    if (opts.count && fileCount > 1)
+        count_report(&count_all, "total");
+    if (opts.hex)
+        hex_finish();
+    uniq_flush();
+    free(line_prefix);
+    free(files);
+#ifdef CC_HAVE_COMPRESS
+    if (out_comp)
+        comp_flush(1);
+#endif
+    tee_flush();
+    fflush(stdout);
+    for (int i = 0; i < tee_out.count; i++) {
+        if (tee_out.fd[i] < 0) {
+            fprintf(stderr, "cc: --tee %s: reader went away, %lld bytes dropped\n", tee_out.path[i],
+                    tee_out.dropped[i]);
+            continue;
+        }
+        if (tee_out.dropped[i])
+            fprintf(stderr, "cc: --tee %s: %lld bytes dropped\n", tee_out.path[i], tee_out.dropped[i]);
+#ifdef _WIN32
+        if (_close(tee_out.fd[i]) < 0)
+#else
+        if (close(tee_out.fd[i]) < 0)
+#endif
+            log_error(tee_out.path[i], 0);
+    }
+    if (opts.progress)
+        progress_finish();
+    if (out_tap)
+        digest_report(digest_out, &out_digest, "(output)");
+    if (digest_out != stderr && fclose(digest_out) != 0)
+        log_error("Failed to close digest file", 0);
     return EXIT_SUCCESS;
 }